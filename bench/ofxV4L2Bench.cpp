@@ -0,0 +1,709 @@
+/**
+ *
+ * ofxV4L2Bench - benchmark of the ofxV4L2 capture pipeline
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESCRIPTION
+ *
+ * Runs ofxV4L2 over every combination of source, resolution and conversion path and
+ * writes one result per combination, as JSON (default) or CSV, to stdout or a file.
+ *
+ * synthetic: generated frames are fed through initSynthetic() / feedFrame(), which
+ *            measures the conversion path without a device
+ * device:    a V4L2 device (e.g. the vivid test driver, sudo modprobe vivid) is opened
+ *            with each io method; every combination runs in a child process, because
+ *            ofxV4L2 exits on device errors (such as an unsupported format)
+ *
+ * kernel:    the line conversion kernels on their own, the generic kernel and (where one is
+ *            registered for the width) the specialized one, to check a specialization pays off,
+ *            and the Bayer unpack and demosaic kernels
+ *
+ * Per combination: frames, sustained fps, cpu time per frame, percentiles of the time
+ * spent per frame in feedFrame() / grabFrame(), percentiles of the latency from the
+ * kernel timestamp to the converted frame (device only) and heap allocations per frame
+ * (counted by interposing malloc).
+ *
+ * Messages of ofxV4L2 itself go to stderr, so stdout only holds the results.
+ *
+ **/
+
+#include "ofxV4L2.h"
+#include "ofxV4L2Kernels.h"
+
+#include <getopt.h>
+#include <sys/wait.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+// heap allocations, counted by interposing the allocation functions of the C library
+static std::atomic<unsigned long> allocations(0);
+
+extern "C"
+{
+	void * __libc_malloc(size_t size);
+	void * __libc_calloc(size_t n, size_t size);
+	void * __libc_realloc(void * p, size_t size);
+	void * __libc_memalign(size_t alignment, size_t size);
+
+	void * malloc(size_t size)
+	{
+		allocations.fetch_add(1, std::memory_order_relaxed);
+		return __libc_malloc(size);
+	}
+
+	void * calloc(size_t n, size_t size)
+	{
+		allocations.fetch_add(1, std::memory_order_relaxed);
+		return __libc_calloc(n, size);
+	}
+
+	void * realloc(void * p, size_t size)
+	{
+		allocations.fetch_add(1, std::memory_order_relaxed);
+		return __libc_realloc(p, size);
+	}
+
+	int posix_memalign(void ** p, size_t alignment, size_t size)
+	{
+		allocations.fetch_add(1, std::memory_order_relaxed);
+		*p = __libc_memalign(alignment, size);
+		return *p ? 0 : ENOMEM;
+	}
+}
+
+// a conversion path: capture format plus the stages that run on it
+struct path
+{
+	const char * name;
+	unsigned int pixelformat;
+	int pixels;
+	int demosaic;
+	bool undistort;
+	int denoise;
+	bool changes;
+};
+
+static const path paths[] =
+{
+	{ "yuyv-gray", V4L2_PIX_FMT_YUYV, PIXELS_GRAY, 0, false, DENOISE_NONE, false },
+	{ "yuyv-rgb", V4L2_PIX_FMT_YUYV, PIXELS_RGB, 0, false, DENOISE_NONE, false },
+	{ "uyvy-gray", V4L2_PIX_FMT_UYVY, PIXELS_GRAY, 0, false, DENOISE_NONE, false },
+	{ "uyvy-rgb", V4L2_PIX_FMT_UYVY, PIXELS_RGB, 0, false, DENOISE_NONE, false },
+	{ "grey-gray", V4L2_PIX_FMT_GREY, PIXELS_GRAY, 0, false, DENOISE_NONE, false },
+	{ "grey-rgb", V4L2_PIX_FMT_GREY, PIXELS_RGB, 0, false, DENOISE_NONE, false },
+	{ "yuyv-gray-changes", V4L2_PIX_FMT_YUYV, PIXELS_GRAY, 0, false, DENOISE_NONE, true },
+	{ "yuyv-gray-recursive", V4L2_PIX_FMT_YUYV, PIXELS_GRAY, 0, false, DENOISE_RECURSIVE, false },
+	{ "yuyv-gray-stack", V4L2_PIX_FMT_YUYV, PIXELS_GRAY, 0, false, DENOISE_STACK, false },
+	{ "yuyv-gray-undistort", V4L2_PIX_FMT_YUYV, PIXELS_GRAY, 0, true, DENOISE_NONE, false },
+	{ "yuyv-rgb-undistort", V4L2_PIX_FMT_YUYV, PIXELS_RGB, 0, true, DENOISE_NONE, false },
+	{ "grbg8-bilinear-gray", V4L2_PIX_FMT_SGRBG8, PIXELS_GRAY, DEMOSAIC_BILINEAR, false, DENOISE_NONE, false },
+	{ "grbg8-bilinear-rgb", V4L2_PIX_FMT_SGRBG8, PIXELS_RGB, DEMOSAIC_BILINEAR, false, DENOISE_NONE, false },
+	{ "grbg8-edge-gray", V4L2_PIX_FMT_SGRBG8, PIXELS_GRAY, DEMOSAIC_EDGE, false, DENOISE_NONE, false },
+	{ "grbg8-edge-rgb", V4L2_PIX_FMT_SGRBG8, PIXELS_RGB, DEMOSAIC_EDGE, false, DENOISE_NONE, false },
+	{ "grbg8-half-gray", V4L2_PIX_FMT_SGRBG8, PIXELS_GRAY, DEMOSAIC_HALF, false, DENOISE_NONE, false },
+	{ "grbg8-half-rgb", V4L2_PIX_FMT_SGRBG8, PIXELS_RGB, DEMOSAIC_HALF, false, DENOISE_NONE, false },
+	{ "rggb10-bilinear-gray", V4L2_PIX_FMT_SRGGB10, PIXELS_GRAY, DEMOSAIC_BILINEAR, false, DENOISE_NONE, false },
+	{ "rggb10-bilinear-rgb", V4L2_PIX_FMT_SRGGB10, PIXELS_RGB, DEMOSAIC_BILINEAR, false, DENOISE_NONE, false },
+	{ "rggb10-edge-gray", V4L2_PIX_FMT_SRGGB10, PIXELS_GRAY, DEMOSAIC_EDGE, false, DENOISE_NONE, false },
+	{ "rggb10-edge-rgb", V4L2_PIX_FMT_SRGGB10, PIXELS_RGB, DEMOSAIC_EDGE, false, DENOISE_NONE, false },
+	{ "rggb10-half-gray", V4L2_PIX_FMT_SRGGB10, PIXELS_GRAY, DEMOSAIC_HALF, false, DENOISE_NONE, false },
+	{ "rggb10-half-rgb", V4L2_PIX_FMT_SRGGB10, PIXELS_RGB, DEMOSAIC_HALF, false, DENOISE_NONE, false },
+	{ "rggb10p-bilinear-rgb", V4L2_PIX_FMT_SRGGB10P, PIXELS_RGB, DEMOSAIC_BILINEAR, false, DENOISE_NONE, false },
+	{ "rggb12p-bilinear-rgb", V4L2_PIX_FMT_SRGGB12P, PIXELS_RGB, DEMOSAIC_BILINEAR, false, DENOISE_NONE, false },
+};
+
+// kernels timed on their own in the kernel runs: line conversion kernels (generic and specialized),
+// Bayer unpack kernels and demosaic kernels (on lines that are unpacked already)
+struct kernelpath
+{
+	const char * name;
+	unsigned int pixelformat;	// capture format, 0 for the demosaic kernels
+	int pixels;
+	int demosaic;				// DEMOSAIC_* for the demosaic kernels, -1 otherwise
+};
+
+static const kernelpath kernelpaths[] =
+{
+	{ "yuyv-gray", V4L2_PIX_FMT_YUYV, PIXELS_GRAY, -1 },
+	{ "yuyv-rgb", V4L2_PIX_FMT_YUYV, PIXELS_RGB, -1 },
+	{ "uyvy-gray", V4L2_PIX_FMT_UYVY, PIXELS_GRAY, -1 },
+	{ "uyvy-rgb", V4L2_PIX_FMT_UYVY, PIXELS_RGB, -1 },
+	{ "grey-gray", V4L2_PIX_FMT_GREY, PIXELS_GRAY, -1 },
+	{ "grey-rgb", V4L2_PIX_FMT_GREY, PIXELS_RGB, -1 },
+	{ "unpack-grbg8", V4L2_PIX_FMT_SGRBG8, 0, -1 },
+	{ "unpack-rggb10", V4L2_PIX_FMT_SRGGB10, 0, -1 },
+	{ "unpack-rggb10p", V4L2_PIX_FMT_SRGGB10P, 0, -1 },
+	{ "unpack-rggb12p", V4L2_PIX_FMT_SRGGB12P, 0, -1 },
+	{ "demosaic-bilinear-gray", 0, PIXELS_GRAY, DEMOSAIC_BILINEAR },
+	{ "demosaic-bilinear-rgb", 0, PIXELS_RGB, DEMOSAIC_BILINEAR },
+	{ "demosaic-edge-gray", 0, PIXELS_GRAY, DEMOSAIC_EDGE },
+	{ "demosaic-edge-rgb", 0, PIXELS_RGB, DEMOSAIC_EDGE },
+	{ "demosaic-half-gray", 0, PIXELS_GRAY, DEMOSAIC_HALF },
+	{ "demosaic-half-rgb", 0, PIXELS_RGB, DEMOSAIC_HALF },
+};
+
+static const char * io_names[] = { "read", "mmap", "userptr" };
+
+struct result
+{
+	char source[16];
+	char io[16];
+	char path[32];
+	char variant[16];
+	int width, height;
+	unsigned long frames;
+	double fps;
+	double cpu_ms;					// cpu time per frame, all threads of the process
+	double frame_ms[4];				// p50, p90, p99 and max of the time spent per frame
+	double latency_ms[4];			// p50, p90, p99 and max of the kernel timestamp to converted frame latency, -1 if unknown
+	double allocs;					// heap allocations per frame
+	char error[64];
+};
+
+struct options
+{
+	const char * device;
+	std::vector<std::pair<int, int> > sizes;
+	std::vector<const path *> paths;
+	std::vector<int> ios;
+	unsigned long frames;
+	double seconds;
+	bool csv;
+	bool synthetic;
+	bool kernels;
+};
+
+static double now_ms(int clock = CLOCK_MONOTONIC)
+{
+	struct timespec ts;
+	clock_gettime (clock, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// p50, p90, p99 and max of the samples
+static void percentiles(std::vector<double> & samples, double * p)
+{
+	if (samples.empty())
+	{
+		p[0] = p[1] = p[2] = p[3] = -1;
+		return;
+	}
+	std::sort (samples.begin(), samples.end());
+	p[0] = samples[(samples.size() - 1) * 50 / 100];
+	p[1] = samples[(samples.size() - 1) * 90 / 100];
+	p[2] = samples[(samples.size() - 1) * 99 / 100];
+	p[3] = samples.back();
+}
+
+static void init_result(result & r, const char * source, const char * io, const char * name, int w, int h)
+{
+	memset (&r, 0, sizeof (r));
+	snprintf (r.source, sizeof (r.source), "%s", source);
+	snprintf (r.io, sizeof (r.io), "%s", io);
+	snprintf (r.path, sizeof (r.path), "%s", name);
+	r.width = w;
+	r.height = h;
+	r.latency_ms[0] = r.latency_ms[1] = r.latency_ms[2] = r.latency_ms[3] = -1;
+}
+
+// applies the settings of a path, before initGrabber() / initSynthetic()
+static void setup_path(ofxV4L2 & cam, const path & p, int w, int h)
+{
+	cam.setCaptureFormat(p.pixelformat);
+	cam.setPixelsFormat(p.pixels);
+	cam.setDemosaic(p.demosaic);
+	if (p.denoise)
+		cam.setDenoise(p.denoise);
+	if (p.changes)
+		cam.setChangeDetection(true);
+	// a moderate barrel distortion, so the lookup table is not an identity
+	if (p.undistort)
+		cam.setUndistort(0.8f * w, 0.8f * w, w / 2.0f, h / 2.0f, -0.25f, 0.08f);
+}
+
+// bytes per line of a synthetic frame
+static unsigned int synthetic_stride(unsigned int pixelformat, int w)
+{
+	const ofxV4L2BayerFormat * bayer = ofxV4L2FindBayer(pixelformat);
+
+	if (bayer)
+		return ofxV4L2BayerLineBytes(bayer, w);
+	return V4L2_PIX_FMT_GREY == pixelformat ? w : 2 * w;
+}
+
+// a gradient with noise, which differs between the two frames so that the denoise and change
+// detection stages have work to do; 10 bit formats get samples below 1024
+static void fill_synthetic(unsigned char * buf, unsigned int stride, int h, unsigned int pixelformat, int frame)
+{
+	unsigned int seed = 12345 + frame;
+	int x, y;
+
+	for (y = 0; y < h; y++)
+	{
+		for (x = 0; x < (int) stride; x++)
+		{
+			seed = seed * 1103515245 + 12345;
+			buf[y * stride + x] = (x + y + frame * 8 + ((seed >> 16) & 15)) & 255;
+			if (V4L2_PIX_FMT_SRGGB10 == pixelformat && (x & 1))
+				buf[y * stride + x] &= 3;
+		}
+	}
+}
+
+static void run_synthetic(const options & o, const path & p, int w, int h, result & r)
+{
+	unsigned int stride = synthetic_stride(p.pixelformat, w);
+	std::vector<unsigned char> buf[2];
+	std::vector<double> times;
+	unsigned long n, allocs;
+	double start, cpu, t;
+	ofxV4L2 cam;
+
+	init_result (r, "synthetic", "-", p.name, w, h);
+	for (n = 0; n < 2; n++)
+	{
+		buf[n].resize((size_t) stride * h);
+		fill_synthetic (&buf[n][0], stride, h, p.pixelformat, n);
+	}
+
+	setup_path (cam, p, w, h);
+	cam.initSynthetic(w, h, p.pixelformat, stride);
+	r.width = cam.getWidth();
+	r.height = cam.getHeight();
+
+	// warm up: first touch of the frames and filter state
+	for (n = 0; n < 4; n++)
+		cam.feedFrame(&buf[n & 1][0], buf[n & 1].size());
+
+	times.reserve(o.frames);
+	allocs = allocations.load();
+	cpu = now_ms(CLOCK_PROCESS_CPUTIME_ID);
+	start = now_ms();
+	for (n = 0; n < o.frames && now_ms() - start < o.seconds * 1000; n++)
+	{
+		t = now_ms();
+		cam.feedFrame(&buf[n & 1][0], buf[n & 1].size());
+		times.push_back(now_ms() - t);
+	}
+	r.frames = n;
+	r.fps = n / ((now_ms() - start) / 1000);
+	r.cpu_ms = (now_ms(CLOCK_PROCESS_CPUTIME_ID) - cpu) / n;
+	r.allocs = (double) (allocations.load() - allocs) / n;
+	percentiles (times, r.frame_ms);
+}
+
+// a frame for one of the kernel runs
+struct kernelframe
+{
+	int width, height;
+	std::vector<unsigned char> src, dst;
+	unsigned int stride, dststride;	// bytes per line
+	ofxV4L2LineKernel kernel;
+	ofxV4L2BayerUnpack unpack;
+	ofxV4L2DemosaicKernel demosaic[4];
+	int mode;
+};
+
+static void convert_frame(kernelframe & f)
+{
+	unsigned char * dst = &f.dst[0];
+	const unsigned char * src = &f.src[0];
+	int y;
+
+	if (f.kernel)
+	{
+		for (y = 0; y < f.height; y++)
+			f.kernel (dst + f.dststride * y, src + f.stride * y, f.width);
+	}
+	else if (f.unpack)
+	{
+		// every line into the same line, bayer_line() reuses three
+		for (y = 0; y < f.height; y++)
+			f.unpack (dst, src + f.stride * y, f.width, 256, 256);
+	}
+	else if (DEMOSAIC_HALF == f.mode)
+	{
+		for (y = 0; y < f.height / 2; y++)
+			f.demosaic[0] (dst + f.dststride * y, src + f.stride * 2 * y + 2, src + f.stride * (2 * y + 1) + 2,
+				NULL, f.width / 2);
+	}
+	else
+	{
+		for (y = 1; y < f.height - 1; y++)
+			f.demosaic[2 * (y & 1)] (dst + f.dststride * y, src + f.stride * (y - 1) + 2, src + f.stride * y + 2,
+				src + f.stride * (y + 1) + 2, f.width);
+	}
+}
+
+static void run_kernel(const options & o, const kernelpath & k, ofxV4L2LineKernel kernel, const char * variant,
+	int w, int h, result & r)
+{
+	const ofxV4L2BayerFormat * bayer = ofxV4L2FindBayer(k.pixelformat);
+	std::vector<double> times;
+	unsigned long n, allocs;
+	double start, cpu, t;
+	kernelframe f;
+
+	init_result (r, "kernel", "-", k.name, w, h);
+	snprintf (r.variant, sizeof (r.variant), "%s", variant);
+
+	f.width = w;
+	f.height = h;
+	f.kernel = kernel;
+	f.unpack = NULL;
+	f.mode = k.demosaic;
+	f.stride = synthetic_stride(k.pixelformat, w);
+	f.dststride = w * k.pixels;
+	if (bayer)
+	{
+		f.unpack = ofxV4L2FindUnpack(bayer);
+		f.dststride = 0;
+		f.dst.resize(w);
+	}
+	else if (k.demosaic >= 0)
+	{
+		// unpacked lines with two samples of padding on either side, as in bayer_line()
+		ofxV4L2FindDemosaic(k.demosaic, k.pixels, f.demosaic);
+		f.stride = w + 4;
+		if (DEMOSAIC_HALF == k.demosaic)
+			f.dststride = w / 2 * k.pixels;
+		f.dst.resize((size_t) f.dststride * h);
+	}
+	else
+		f.dst.resize((size_t) f.dststride * h);
+	f.src.resize((size_t) f.stride * h);
+	fill_synthetic (&f.src[0], f.stride, h, k.pixelformat, 0);
+	convert_frame (f);
+
+	times.reserve(o.frames);
+	allocs = allocations.load();
+	cpu = now_ms(CLOCK_PROCESS_CPUTIME_ID);
+	start = now_ms();
+	for (n = 0; n < o.frames && now_ms() - start < o.seconds * 1000; n++)
+	{
+		t = now_ms();
+		convert_frame (f);
+		times.push_back(now_ms() - t);
+	}
+	r.frames = n;
+	r.fps = n / ((now_ms() - start) / 1000);
+	r.cpu_ms = (now_ms(CLOCK_PROCESS_CPUTIME_ID) - cpu) / n;
+	r.allocs = (double) (allocations.load() - allocs) / n;
+	percentiles (times, r.frame_ms);
+}
+
+// runs in a child process, see run_device()
+static void device_child(const options & o, const path & p, int io, int w, int h, result & r)
+{
+	std::vector<double> times, latencies;
+	unsigned long n, allocs;
+	double start, cpu, t;
+	ofxV4L2 cam;
+
+	setup_path (cam, p, w, h);
+	cam.initGrabber(o.device, io, w, h);
+	r.width = cam.getWidth();
+	r.height = cam.getHeight();
+
+	for (n = 0; n < 10; n++)
+		cam.grabFrame();
+
+	times.reserve(o.frames);
+	latencies.reserve(o.frames);
+	cam.resetStats();
+	allocs = allocations.load();
+	cpu = now_ms(CLOCK_PROCESS_CPUTIME_ID);
+	start = now_ms();
+	for (n = 0; n < o.frames && now_ms() - start < o.seconds * 1000; )
+	{
+		t = now_ms();
+		cam.grabFrame();
+		if (!cam.isNewFrame())
+			continue;
+		times.push_back(now_ms() - t);
+
+		// the timestamp is only comparable with the monotonic clock for mmap and userptr i/o
+		const ofxV4L2::frameinfo & fi = cam.getFrameInfo();
+		if ((fi.tsflags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+			latencies.push_back(now_ms() - (fi.timestamp.tv_sec * 1000.0 + fi.timestamp.tv_usec / 1000.0));
+		n++;
+	}
+	r.frames = n;
+	r.fps = n / ((now_ms() - start) / 1000);
+	r.cpu_ms = n ? (now_ms(CLOCK_PROCESS_CPUTIME_ID) - cpu) / n : 0;
+	r.allocs = n ? (double) (allocations.load() - allocs) / n : 0;
+	percentiles (times, r.frame_ms);
+	percentiles (latencies, r.latency_ms);
+}
+
+static void run_device(const options & o, const path & p, int io, int w, int h, result & r)
+{
+	int fds[2], status;
+	pid_t pid;
+
+	init_result (r, "device", io_names[io], p.name, w, h);
+	if (-1 == pipe (fds))
+	{
+		snprintf (r.error, sizeof (r.error), "pipe: %s", strerror (errno));
+		return;
+	}
+
+	fflush (NULL);
+	pid = fork ();
+	if (0 == pid)
+	{
+		close (fds[0]);
+		device_child (o, p, io, w, h, r);
+		if (write (fds[1], &r, sizeof (r)) != sizeof (r))
+			_exit (EXIT_FAILURE);
+		fflush (NULL);
+		_exit (EXIT_SUCCESS);
+	}
+
+	close (fds[1]);
+	if (-1 == pid || read (fds[0], &r, sizeof (r)) != sizeof (r))
+		snprintf (r.error, sizeof (r.error), "not supported by %s", o.device);
+	close (fds[0]);
+	if (pid > 0)
+		waitpid (pid, &status, 0);
+}
+
+static void write_header(FILE * out, bool csv)
+{
+	if (csv)
+		fprintf (out, "source,io,path,variant,width,height,frames,fps,cpu_ms,"
+			"frame_ms_p50,frame_ms_p90,frame_ms_p99,frame_ms_max,"
+			"latency_ms_p50,latency_ms_p90,latency_ms_p99,latency_ms_max,allocs_per_frame,error\n");
+	else
+		fprintf (out, "{\"results\":[");
+}
+
+static void write_result(FILE * out, bool csv, const result & r, bool first)
+{
+	if (csv)
+	{
+		fprintf (out, "%s,%s,%s,%s,%d,%d,%lu,%.2f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.3f,%s\n",
+			r.source, r.io, r.path, r.variant, r.width, r.height, r.frames, r.fps, r.cpu_ms,
+			r.frame_ms[0], r.frame_ms[1], r.frame_ms[2], r.frame_ms[3],
+			r.latency_ms[0], r.latency_ms[1], r.latency_ms[2], r.latency_ms[3], r.allocs, r.error);
+	}
+	else
+	{
+		fprintf (out, "%s\n{\"source\":\"%s\",\"io\":\"%s\",\"path\":\"%s\",\"variant\":\"%s\",\"width\":%d,\"height\":%d,"
+			"\"frames\":%lu,\"fps\":%.2f,\"cpu_ms\":%.4f,\"frame_ms\":{\"p50\":%.4f,\"p90\":%.4f,\"p99\":%.4f,\"max\":%.4f},",
+			first ? "" : ",", r.source, r.io, r.path, r.variant, r.width, r.height, r.frames, r.fps, r.cpu_ms,
+			r.frame_ms[0], r.frame_ms[1], r.frame_ms[2], r.frame_ms[3]);
+		if (r.latency_ms[0] < 0)
+			fprintf (out, "\"latency_ms\":null,");
+		else
+			fprintf (out, "\"latency_ms\":{\"p50\":%.4f,\"p90\":%.4f,\"p99\":%.4f,\"max\":%.4f},",
+				r.latency_ms[0], r.latency_ms[1], r.latency_ms[2], r.latency_ms[3]);
+		fprintf (out, "\"allocs_per_frame\":%.3f,\"error\":%s%s%s}", r.allocs,
+			r.error[0] ? "\"" : "", r.error[0] ? r.error : "null", r.error[0] ? "\"" : "");
+	}
+	fflush (out);
+}
+
+static void write_footer(FILE * out, bool csv)
+{
+	if (!csv)
+		fprintf (out, "\n]}\n");
+}
+
+static void usage(const char * name)
+{
+	unsigned int i;
+
+	fprintf (stderr, "Usage: %s [options]\n\n"
+		"-d, --device DEV     also run against DEV (e.g. /dev/video0 with the vivid driver)\n"
+		"-i, --io LIST        io methods for the device: read,mmap,userptr (default: all)\n"
+		"-s, --sizes LIST     resolutions, default 640x480,1280x720,1920x1080,3840x2160\n"
+		"-p, --paths LIST     conversion paths (default: all, see below)\n"
+		"-n, --frames N       frames per combination (default 100)\n"
+		"-t, --seconds S      at most S seconds per combination (default 2)\n"
+		"-c, --csv            write CSV instead of JSON\n"
+		"-o, --output FILE    write the results to FILE instead of stdout\n"
+		"-S, --no-synthetic   skip the synthetic source\n"
+		"-K, --no-kernels     skip the comparison of generic and specialized kernels\n"
+		"\nPaths:", name);
+	for (i = 0; i < sizeof (paths) / sizeof (paths[0]); i++)
+		fprintf (stderr, " %s", paths[i].name);
+	fprintf (stderr, "\n");
+}
+
+// splits a comma separated list
+static std::vector<std::string> split(const char * list)
+{
+	std::vector<std::string> items;
+	std::string s(list);
+	size_t start = 0, end;
+
+	do
+	{
+		end = s.find(',', start);
+		items.push_back(s.substr(start, end == std::string::npos ? end : end - start));
+		start = end + 1;
+	}
+	while (end != std::string::npos);
+	return items;
+}
+
+int main(int argc, char ** argv)
+{
+	static const struct option long_options[] =
+	{
+		{ "device", required_argument, NULL, 'd' },
+		{ "io", required_argument, NULL, 'i' },
+		{ "sizes", required_argument, NULL, 's' },
+		{ "paths", required_argument, NULL, 'p' },
+		{ "frames", required_argument, NULL, 'n' },
+		{ "seconds", required_argument, NULL, 't' },
+		{ "csv", no_argument, NULL, 'c' },
+		{ "output", required_argument, NULL, 'o' },
+		{ "no-synthetic", no_argument, NULL, 'S' },
+		{ "no-kernels", no_argument, NULL, 'K' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const char * sizes = "640x480,1280x720,1920x1080,3840x2160";
+	const char * pathlist = NULL, * iolist = "read,mmap,userptr", * output = NULL;
+	std::vector<std::string> items;
+	unsigned int i, j, k;
+	bool first = true, specialized;
+	options o;
+	result r;
+	FILE * out;
+	int c, w, h;
+
+	o.device = NULL;
+	o.frames = 100;
+	o.seconds = 2;
+	o.csv = false;
+	o.synthetic = true;
+	o.kernels = true;
+
+	while (-1 != (c = getopt_long (argc, argv, "d:i:s:p:n:t:co:SKh", long_options, NULL)))
+	{
+		switch (c)
+		{
+			case 'd': o.device = optarg; break;
+			case 'i': iolist = optarg; break;
+			case 's': sizes = optarg; break;
+			case 'p': pathlist = optarg; break;
+			case 'n': o.frames = strtoul (optarg, NULL, 0); break;
+			case 't': o.seconds = atof (optarg); break;
+			case 'c': o.csv = true; break;
+			case 'o': output = optarg; break;
+			case 'S': o.synthetic = false; break;
+			case 'K': o.kernels = false; break;
+			default:
+				usage (argv[0]);
+				return 'h' == c ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	items = split(sizes);
+	for (i = 0; i < items.size(); i++)
+	{
+		if (2 != sscanf (items[i].c_str(), "%dx%d", &w, &h) || w < 16 || h < 16 || (w & 1) || (h & 1))
+		{
+			fprintf (stderr, "Bad resolution '%s'\n", items[i].c_str());
+			return EXIT_FAILURE;
+		}
+		o.sizes.push_back(std::make_pair(w, h));
+	}
+
+	for (i = 0; i < sizeof (paths) / sizeof (paths[0]); i++)
+		if (!pathlist)
+			o.paths.push_back(&paths[i]);
+	if (pathlist)
+	{
+		items = split(pathlist);
+		for (i = 0; i < items.size(); i++)
+		{
+			for (j = 0; j < sizeof (paths) / sizeof (paths[0]) && items[i] != paths[j].name; j++)
+				;
+			if (j == sizeof (paths) / sizeof (paths[0]))
+			{
+				fprintf (stderr, "Unknown path '%s'\n", items[i].c_str());
+				return EXIT_FAILURE;
+			}
+			o.paths.push_back(&paths[j]);
+		}
+	}
+
+	items = split(iolist);
+	for (i = 0; i < items.size(); i++)
+	{
+		for (j = 0; j < 3 && items[i] != io_names[j]; j++)
+			;
+		if (3 == j)
+		{
+			fprintf (stderr, "Unknown io method '%s'\n", items[i].c_str());
+			return EXIT_FAILURE;
+		}
+		o.ios.push_back(j);
+	}
+
+	// results go to the original stdout, anything ofxV4L2 prints to stderr
+	out = output ? fopen (output, "w") : fdopen (dup (STDOUT_FILENO), "w");
+	if (!out)
+	{
+		fprintf (stderr, "Cannot write %s: %s\n", output, strerror (errno));
+		return EXIT_FAILURE;
+	}
+	fflush (stdout);
+	dup2 (STDERR_FILENO, STDOUT_FILENO);
+
+	write_header (out, o.csv);
+	for (i = 0; i < o.sizes.size(); i++)
+	{
+		w = o.sizes[i].first;
+		h = o.sizes[i].second;
+		for (j = 0; o.kernels && j < sizeof (kernelpaths) / sizeof (kernelpaths[0]); j++)
+		{
+			const kernelpath & kp = kernelpaths[j];
+			ofxV4L2LineKernel kernel = ofxV4L2FindKernel(kp.pixelformat, kp.pixels, w, &specialized);
+			if (kernel && specialized)
+			{
+				run_kernel (o, kp, kernel, "specialized", w, h, r);
+				write_result (out, o.csv, r, first);
+				first = false;
+			}
+			run_kernel (o, kp, kernel ? ofxV4L2FindKernel(kp.pixelformat, kp.pixels, 0) : NULL, "generic", w, h, r);
+			write_result (out, o.csv, r, first);
+			first = false;
+		}
+		for (j = 0; j < o.paths.size(); j++)
+		{
+			if (o.synthetic)
+			{
+				run_synthetic (o, *o.paths[j], w, h, r);
+				write_result (out, o.csv, r, first);
+				first = false;
+			}
+			for (k = 0; o.device && k < o.ios.size(); k++)
+			{
+				run_device (o, *o.paths[j], o.ios[k], w, h, r);
+				write_result (out, o.csv, r, first);
+				first = false;
+			}
+		}
+	}
+	write_footer (out, o.csv);
+	fclose (out);
+	return EXIT_SUCCESS;
+}
@@ -41,10 +41,75 @@
  **/
 
 #include "ofxV4L2.h"
+#include "ofxV4L2FrameServer.h"
+#include "ofxV4L2Recorder.h"
+#include "ofxV4L2Kernels.h"
+#include "ofxV4L2Trace.h"
+
+// monotonic time in milliseconds, used for the capture statistics
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
 
 ofxV4L2::ofxV4L2()
 {
+	fd = -1;
+	buftype = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	pixels = PIXELS_GRAY;
+	kernel = NULL;
+	capture_format = V4L2_PIX_FMT_YUYV;
+	bayer = NULL;
+	demosaic = DEMOSAIC_BILINEAR;
+	bayerlines = NULL;
+	unpack = NULL;
+	remap = false;
+	mapoffset = NULL;
+	mapfrac = NULL;
+	setWhiteBalance(1, 1, 1);
+	consumer_trace = 0;
+	sink = NULL;
+	for (int i = 0; i < N_FRAMES; i++)
+	{
+		frames[i] = NULL;
+		memset (&info[i], 0, sizeof (info[i]));
+		info[i].changed = true;
+	}
 	v4l2framerate = 0;
+	newframe = false;
+	realtime = false;
+	running = false;
+	deinterlace = DEINTERLACE_WEAVE;
+	fieldrate = false;
+	fieldpending = false;
+	apppending = false;
+	linebuf = NULL;
+	denoise = DENOISE_NONE;
+	denoise_acc = NULL;
+	denoise_ring = NULL;
+	field = V4L2_FIELD_NONE;
+	firstfield = curfield = 0;
+	meta_name = NULL;
+	server = NULL;
+	serve_name = NULL;
+	recorder = new ofxV4L2Recorder;
+	record_raw = true;
+	meta_fd = -1;
+	meta_held = false;
+	exposure = gain = autogain = -1;
+	changedetect = false;
+	framechanged = true;
+	changeref = NULL;
+	tilesad = NULL;
+	tilelimit = NULL;
+	changedtiles = NULL;
+	tilesX = tilesY = 0;
+	statsreset = 0;
+	statsseen = 0;
+	memset (slotreset, 0, sizeof (slotreset));
+	resetStats();
 }
 
 bool ofxV4L2::settings(int id, int val)
@@ -52,12 +117,57 @@ bool ofxV4L2::settings(int id, int val)
 	struct v4l2_control argptr;
 	argptr.id = id;
 	argptr.value = val;
-	return xioctl(fd, VIDIOC_S_CTRL, &argptr);
+	if (-1 == xioctl(fd, VIDIOC_S_CTRL, &argptr))
+		return -1;
+	cache_control(id, val);
+	return 0;
+}
+
+// keeps the values of the controls that are reported with every frame (see frameinfo)
+void ofxV4L2::cache_control(int id, int val)
+{
+	switch (id)
+	{
+		case ofxV4L2_EXPOSURE:
+			exposure = val;
+			break;
+		case ofxV4L2_GAIN:
+			gain = val;
+			break;
+		case ofxV4L2_AUTOGAIN:
+			autogain = val;
+			break;
+	}
+}
+
+// reads the current value of the cached controls from the device, called inside initGrabber()
+void ofxV4L2::init_control_cache(void)
+{
+	static const int ids[] = { ofxV4L2_EXPOSURE, ofxV4L2_GAIN, ofxV4L2_AUTOGAIN };
+	struct v4l2_control ctrl;
+	unsigned int i;
+
+	for (i = 0; i < sizeof (ids) / sizeof (ids[0]); i++)
+	{
+		CLEAR (ctrl);
+		ctrl.id = ids[i];
+		cache_control(ids[i], -1 == xioctl(fd, VIDIOC_G_CTRL, &ctrl) ? -1 : ctrl.value);
+	}
+}
+
+const ofxV4L2::frameinfo & ofxV4L2::getFrameInfo(void)
+{
+	return info[front];
+}
+
+void ofxV4L2::setMetadataDevice(const char * devname)
+{
+	meta_name = devname;
 }
 
 unsigned char * ofxV4L2::getPixels(void)
 {
-	return image;
+	return frames[front];
 }
 
 bool ofxV4L2::setDesiredFramerate(int fr)
@@ -75,6 +185,154 @@ bool ofxV4L2::setDesiredFramerate(int fr)
 	}
 }
 
+const ofxV4L2::stats & ofxV4L2::getStats(void)
+{
+	return realtime ? appstats : framestats;
+}
+
+void ofxV4L2::resetStats(void)
+{
+	CLEAR (appstats);
+	// the capture thread writes framestats in real-time mode: ask it to clear them
+	if (realtime)
+		statsreset++;
+	else
+		CLEAR (framestats);
+}
+
+void ofxV4L2::setChangeDetection(bool enable, int size, int threshold)
+{
+	changedetect = enable;
+	tilesize = size < 2 ? 2 : size & ~1;	// keep tiles aligned to the sampling grid
+	tilethreshold = threshold;
+}
+
+bool ofxV4L2::isFrameChanged()
+{
+	return info[front].changed;
+}
+
+const unsigned char * ofxV4L2::getChangedTiles()
+{
+	// the map of every frame is kept next to it, so the capture thread never writes the app's one
+	return changedtiles ? changedtiles + front * tilesX * tilesY : NULL;
+}
+
+int ofxV4L2::getTilesX()
+{
+	return tilesX;
+}
+
+int ofxV4L2::getTilesY()
+{
+	return tilesY;
+}
+
+void ofxV4L2::setRealtime(int priority, int cpu)
+{
+	realtime = true;
+	rtpriority = priority;
+	rtcpu = cpu;
+}
+
+void ofxV4L2::setDeinterlace(int mode, bool fieldrateoutput, int threshold)
+{
+	deinterlace = mode;
+	fieldrate = fieldrateoutput;
+	deinterlace_threshold = threshold;
+}
+
+int ofxV4L2::getField()
+{
+	return field;
+}
+
+void ofxV4L2::serveFrames(const char * name, bool raw, int slots)
+{
+	serve_name = name;
+	serve_raw = raw;
+	serve_slots = slots;
+}
+
+bool ofxV4L2::startRecording(const char * filename, bool raw, int codec, bool delta, int threads)
+{
+	// the recorder ignores frames until it is open, so the capture thread can keep running
+	record_raw = raw;
+	if (raw)
+		return recorder->open(filename, camWidth, camHeight, imagesize, pixelformat, codec, delta, threads);
+	return recorder->open(filename, width, height, framesize, pixels_fourcc(), codec, delta, threads);
+}
+
+bool ofxV4L2::stopRecording(void)
+{
+	return recorder->close();
+}
+
+ofxV4L2Recorder & ofxV4L2::getRecorder(void)
+{
+	return *recorder;
+}
+
+void ofxV4L2::setDenoise(int mode, int strength, int threshold, int frames)
+{
+	denoise = mode;
+	denoise_strength = strength < 1 ? 1 : (strength > 256 ? 256 : strength);
+	denoise_threshold = threshold;
+	denoise_frames = frames < 2 ? 2 : (frames > 256 ? 256 : frames);
+}
+
+void ofxV4L2::setPixelsFormat(int format)
+{
+	pixels = format;
+}
+
+int ofxV4L2::getPixelsFormat()
+{
+	return pixels;
+}
+
+int ofxV4L2::getWidth()
+{
+	return width;
+}
+
+int ofxV4L2::getHeight()
+{
+	return height;
+}
+
+void ofxV4L2::setCaptureFormat(unsigned int fourcc)
+{
+	capture_format = fourcc;
+}
+
+void ofxV4L2::setDemosaic(int mode)
+{
+	demosaic = mode;
+}
+
+void ofxV4L2::setUndistort(float fx, float fy, float cx, float cy, float k1, float k2, float p1, float p2, float k3)
+{
+	remap = true;
+	intrinsics[0] = fx;
+	intrinsics[1] = fy;
+	intrinsics[2] = cx;
+	intrinsics[3] = cy;
+	distortion[0] = k1;
+	distortion[1] = k2;
+	distortion[2] = p1;
+	distortion[3] = p2;
+	distortion[4] = k3;
+}
+
+void ofxV4L2::setWhiteBalance(float red, float green, float blue)
+{
+	float gains[3] = { red, green, blue };
+
+	for (int i = 0; i < 3; i++)
+		wbgain[i] = gains[i] < 0 ? 0 : (gains[i] > 16 ? 4096 : (int) (gains[i] * 256 + 0.5f));
+}
+
 bool ofxV4L2::isNewFrame()
 {
 	return newframe;
@@ -84,11 +342,8 @@ void ofxV4L2::initGrabber(const char * devname, int iomethod, int cw, int ch)
 {
 	// set input/output method
 	io = iomethod;
-	// set resolution used for capture
-	camWidth = cw;
-	camHeight = ch;
-	image = new unsigned char[camWidth * camHeight];
 	dev_name = devname;
+	init_frames(cw, ch);
 
 	// check if framerate was set externally
 	if(v4l2framerate == 0)
@@ -99,8 +354,59 @@ void ofxV4L2::initGrabber(const char * devname, int iomethod, int cw, int ch)
 
 	open_device(dev_name);
     init_device();
+	init_processing();
+	init_control_cache();
     start_capturing();
+	if (meta_name)
+		init_meta();
+	if (realtime)
+		start_thread();
+
+}
 
+// allocates the converted frames for a capture of cw x ch, called inside initGrabber()
+void ofxV4L2::init_frames(int cw, int ch)
+{
+	// set resolution used for capture
+	camWidth = cw;
+	camHeight = ch;
+	// Bayer frames are demosaiced into frames of half the size in DEMOSAIC_HALF mode
+	bayer = ofxV4L2FindBayer(capture_format);
+	width = bayer && DEMOSAIC_HALF == demosaic ? camWidth / 2 : camWidth;
+	height = bayer && DEMOSAIC_HALF == demosaic ? camHeight / 2 : camHeight;
+	linesize = width * pixels;
+	framesize = linesize * height;
+	// the app reads the front frame, the second field in field-rate mode goes to frames[fieldslot]
+	// in real-time mode the capture thread converts into back (and fieldslot) and exchanges that
+	// pair with the ready one, the app exchanges its pair front / appfield (a lock-free triple
+	// buffer of pairs, so the second field is never separated from the first one)
+	for (int i = 0; i < (realtime ? N_FRAMES : 2); i++)
+		frames[i] = new unsigned char[framesize];
+	front = 0;
+	appfield = 1;
+	apppending = false;
+	ready = 2 | 3 << 3;
+	back = realtime ? 4 : 0;
+	fieldslot = realtime ? 5 : 1;
+	output = frames[back];
+}
+
+// sets up conversion and the stages after it for the negotiated format, called inside initGrabber()
+void ofxV4L2::init_processing(void)
+{
+	linebuf = new unsigned char[bytesperline];
+	select_kernel();
+	if (serve_name)
+	{
+		server = new ofxV4L2FrameServer;
+		if (serve_raw ? !server->setup(serve_name, camWidth, camHeight, imagesize, pixelformat, serve_slots)
+			: !server->setup(serve_name, width, height, framesize, pixels_fourcc(), serve_slots))
+			exit (EXIT_FAILURE);
+	}
+	if (changedetect)
+		init_change_detection();
+	if (denoise)
+		init_denoise();
 }
 
 // error output
@@ -119,64 +425,589 @@ int ofxV4L2::xioctl (int fd, int request, void * arg)
     return r;
 }
 
-void ofxV4L2::process_image(const void * p, int length)
+// allocates the tile administration, called inside initGrabber()
+void ofxV4L2::init_change_detection(void)
+{
+	int tx, ty, w, h;
+
+	tilesX = (width + tilesize - 1) / tilesize;
+	tilesY = (height + tilesize - 1) / tilesize;
+	changeref = new unsigned char[((width + 1) / 2) * ((height + 1) / 2)];
+	tilesad = new unsigned int[tilesX * tilesY];
+	tilelimit = new unsigned int[tilesX * tilesY];
+	changedtiles = new unsigned char[N_FRAMES * tilesX * tilesY];
+
+	// the number of sampled pixels differs for tiles at the right and bottom edge
+	for (ty = 0; ty < tilesY; ty++)
+	{
+		h = height - ty * tilesize < tilesize ? height - ty * tilesize : tilesize;
+		for (tx = 0; tx < tilesX; tx++)
+		{
+			w = width - tx * tilesize < tilesize ? width - tx * tilesize : tilesize;
+			tilelimit[tx + ty * tilesX] = tilethreshold * ((w + 1) / 2) * ((h + 1) / 2);
+		}
+	}
+
+	memset (changedtiles, 1, N_FRAMES * tilesX * tilesY);
+	framechanged = true;
+	changefirst = true;
+}
+
+// compares a freshly converted (even) line against the reference and updates the reference
+// RGB frames are compared on their green channel
+void ofxV4L2::detect_changes(const unsigned char * line, int row)
+{
+	int pixels = this->pixels;
+	unsigned char * ref = changeref + (row / 2) * ((width + 1) / 2);
+	unsigned int * sad = tilesad + (row / tilesize) * tilesX;
+	int col, end, d;
+	unsigned int sum;
+
+	for (col = 0; col < width; col = end)
+	{
+		end = col + tilesize < width ? col + tilesize : width;
+		sum = 0;
+		for (; col < end; col += 2)
+		{
+			d = line[col * pixels + (pixels > 1)] - ref[col / 2];
+			sum += d < 0 ? -d : d;
+			ref[col / 2] = line[col * pixels + (pixels > 1)];
+		}
+		*sad++ += sum;
+	}
+}
+
+// fills the tile map of the back frame
+void ofxV4L2::finish_change_detection(void)
+{
+	unsigned char * tiles = changedtiles + back * tilesX * tilesY;
+	int i;
+
+	framechanged = changefirst;
+	for (i = 0; i < tilesX * tilesY; i++)
+	{
+		tiles[i] = changefirst || tilesad[i] > tilelimit[i];
+		framechanged = framechanged || tiles[i];
+	}
+	changefirst = false;
+}
+
+// line kernels, written as plain loops over restrict pointers so the compiler vectorizes them
+// (CMakeLists.txt turns on the vectorizer for GCC at -O2 too; the conversion kernels are in ofxV4L2Kernels.h)
+
+// average of two raw lines (bob)
+static void average_line(unsigned char * __restrict dst, const unsigned char * __restrict a, const unsigned char * __restrict b, int length)
+{
+	for (int i = 0; i < length; i++)
+		dst[i] = (a[i] + b[i] + 1) >> 1;
+}
+
+// motion adaptive: keep the line of the other field where it matches the interpolation
+// of the neighbouring lines (static picture), use the interpolation where it does not (motion)
+static void adaptive_line(unsigned char * __restrict dst, const unsigned char * __restrict a, const unsigned char * __restrict b,
+	const unsigned char * __restrict other, int length, int threshold)
+{
+	for (int i = 0; i < length; i++)
+	{
+		int interp = (a[i] + b[i] + 1) >> 1;
+		int d = other[i] - interp;
+		dst[i] = (d < threshold && d > -threshold) ? other[i] : interp;
+	}
+}
+
+// recursive temporal filter: acc holds the running average in 8.8 fixed point
+// pixels that differ more than threshold from the average are moving and restart it
+static void recursive_line(unsigned char * __restrict px, unsigned short * __restrict acc, int width, int alpha, int threshold)
+{
+	for (int i = 0; i < width; i++)
+	{
+		int x = px[i] << 8;
+		int d = x - acc[i];
+		int a = (d > threshold || d < -threshold) ? x : acc[i] + ((d * alpha) >> 8);
+		acc[i] = a;
+		px[i] = (a + 128) >> 8;
+	}
+}
+
+// frame stacking: mean of the last n frames, kept as a running sum over a ring of frames
+// pixels that differ more than threshold from the mean are moving and passed through
+static void stack_line(unsigned char * __restrict px, unsigned short * __restrict sum, unsigned char * __restrict oldest,
+	int width, unsigned int recip, int threshold)
+{
+	for (int i = 0; i < width; i++)
+	{
+		int s = sum[i] + px[i] - oldest[i];
+		int mean = (s * recip) >> 16;
+		int d = px[i] - mean;
+		sum[i] = s;
+		oldest[i] = px[i];
+		px[i] = (d > threshold || d < -threshold) ? px[i] : mean;
+	}
+}
+
+// true for buffers that hold a single field of camHeight / 2 lines
+static bool single_field(int field)
+{
+	return V4L2_FIELD_ALTERNATE == field || V4L2_FIELD_TOP == field || V4L2_FIELD_BOTTOM == field;
+}
+
+// line of a frame that holds both fields, for both interleaved and sequential field storage
+const unsigned char * ofxV4L2::frame_line(const unsigned char * p, int row)
+{
+	switch (field)
+	{
+		case V4L2_FIELD_SEQ_TB:
+			return p + ((row & 1) * (camHeight / 2) + row / 2) * bytesperline;
+		case V4L2_FIELD_SEQ_BT:
+			return p + ((1 - (row & 1)) * (camHeight / 2) + row / 2) * bytesperline;
+		default:
+			return p + row * bytesperline;
+	}
+}
+
+// raw line for output row 'row', built from field 'parity' (0: top, 1: bottom) according to the
+// deinterlace mode; interpolated lines are written into 'tmp'
+const unsigned char * ofxV4L2::field_line(const unsigned char * p, int row, int parity, unsigned char * tmp)
+{
+	const unsigned char * above, * below;
+	int len = bytesperline;
+
+	if (single_field(field))
+	{
+		// the buffer holds a single field of camHeight / 2 lines
+		int k = row / 2, last = (camHeight + 1 - parity) / 2 - 1;
+		if ((row & 1) == parity)
+			return p + k * len;
+		above = p + (parity ? (k > 0 ? k - 1 : 0) : k) * len;
+		below = p + (parity ? k : (k + 1 <= last ? k + 1 : last)) * len;
+		average_line (tmp, above, below, len);
+		return tmp;
+	}
+
+	if (DEINTERLACE_WEAVE == deinterlace || V4L2_FIELD_NONE == field || (row & 1) == parity)
+		return frame_line(p, row);
+
+	above = frame_line(p, row > 0 ? row - 1 : row + 1);
+	below = frame_line(p, row + 1 < camHeight ? row + 1 : row - 1);
+	if (DEINTERLACE_ADAPTIVE == deinterlace)
+		adaptive_line (tmp, above, below, frame_line(p, row), len, deinterlace_threshold);
+	else
+		average_line (tmp, above, below, len);
+	return tmp;
+}
+
+// allocates the (aligned) filter state, called inside initGrabber()
+void ofxV4L2::init_denoise(void)
+{
+	if (posix_memalign ((void **) &denoise_acc, 64, framesize * sizeof (*denoise_acc))
+		|| (DENOISE_STACK == denoise && posix_memalign ((void **) &denoise_ring, 64, framesize * denoise_frames)))
+	{
+		fprintf (stderr, "Out of memory\n");
+		exit (EXIT_FAILURE);
+	}
+	denoise_next = 0;
+	denoise_first = true;
+}
+
+// filters a converted line in place
+// later is 1 for the second field in field-rate mode, which is the frame after this one in time
+void ofxV4L2::denoise_line(unsigned char * line, int row, int later)
+{
+	unsigned short * acc = denoise_acc + row * linesize;
+	unsigned char * ring;
+	int i, n;
+
+	if (DENOISE_RECURSIVE == denoise)
+	{
+		if (denoise_first && !later)
+			for (i = 0; i < linesize; i++)
+				acc[i] = line[i] << 8;
+		recursive_line (line, acc, linesize, denoise_strength, denoise_threshold << 8);
+		return;
+	}
+
+	// the ring holds denoise_frames frames; denoise_next is the oldest one, replaced by this frame
+	n = (denoise_next + later) % denoise_frames;
+	ring = denoise_ring + (size_t) n * framesize + row * linesize;
+	if (denoise_first && !later)
+	{
+		for (n = 0; n < denoise_frames; n++)
+			memcpy (denoise_ring + (size_t) n * framesize + row * linesize, line, linesize);
+		for (i = 0; i < linesize; i++)
+			acc[i] = line[i] * denoise_frames;
+	}
+	stack_line (line, acc, ring, linesize, (65536 + denoise_frames - 1) / denoise_frames, denoise_threshold);
+}
+
+// called after every buffer that went through denoise_line(), frames is 2 in field-rate mode
+void ofxV4L2::next_denoise_frame(int frames)
+{
+	denoise_first = false;
+	if (DENOISE_STACK == denoise)
+		denoise_next = (denoise_next + frames) % denoise_frames;
+}
+
+// fourcc of the frames returned by getPixels()
+unsigned int ofxV4L2::pixels_fourcc(void)
+{
+	return PIXELS_RGB == pixels ? V4L2_PIX_FMT_RGB24 : V4L2_PIX_FMT_GREY;
+}
+
+// picks the conversion kernel for the negotiated format and width, called inside initGrabber()
+void ofxV4L2::select_kernel(void)
+{
+	bool specialized;
+	char fourcc[5];
+
+	memcpy (fourcc, &pixelformat, 4);
+	fourcc[4] = 0;
+	if (!bayer != !ofxV4L2FindBayer(pixelformat))
+	{
+		fprintf (stderr, "%s does not support the requested pixel format (it offered %s)\n", dev_name, fourcc);
+		exit (EXIT_FAILURE);
+	}
+	if (remap)
+	{
+		init_remap();
+		return;
+	}
+	if (bayer)
+	{
+		select_demosaic();
+		return;
+	}
+
+	kernel = ofxV4L2FindKernel(pixelformat, pixels, width, &specialized);
+	if (!kernel)
+	{
+		fprintf (stderr, "Pixel format %s of %s cannot be converted\n", fourcc, dev_name);
+		exit (EXIT_FAILURE);
+	}
+	fprintf (stdout, "Using %s conversion kernel for %s at width %d\n", specialized ? "specialized" : "generic", fourcc, width);
+}
+
+// picks the unpack and demosaic kernels for a Bayer format, called inside initGrabber()
+void ofxV4L2::select_demosaic(void)
+{
+	bayer = ofxV4L2FindBayer(pixelformat);
+	unpack = ofxV4L2FindUnpack(bayer);
+	if (bayer->packed && camWidth % (10 == bayer->bits ? 4 : 2))
+	{
+		fprintf (stderr, "Width %d of %s is no multiple of the packed %d bit sample groups\n", camWidth, dev_name, bayer->bits);
+		exit (EXIT_FAILURE);
+	}
+	if (!ofxV4L2FindDemosaic(demosaic, pixels, demosaic_kernels))
+	{
+		fprintf (stderr, "Unknown demosaic mode %d\n", demosaic);
+		exit (EXIT_FAILURE);
+	}
+	bayerlines = new unsigned char[3 * (camWidth + 4)];
+	fprintf (stdout, "Demosaicing %d bit%s Bayer frames from %s\n", bayer->bits, bayer->packed ? " packed" : "", dev_name);
+}
+
+// computes the lookup table of the undistortion, called inside initGrabber()
+// for every output pixel the pinhole model with distortion gives the point of the captured
+// frame it shows; the table holds that point as a sample offset and 8 bit fractions
+void ofxV4L2::init_remap(void)
+{
+	const ofxV4L2RemapFormat * f = ofxV4L2FindRemap(pixelformat);
+	double fx = intrinsics[0], fy = intrinsics[1], cx = intrinsics[2], cy = intrinsics[3];
+	double k1 = distortion[0], k2 = distortion[1], p1 = distortion[2], p2 = distortion[3], k3 = distortion[4];
+	double x, y, r2, radial, u, v;
+	int row, col, u0, v0, fu, fv;
+	size_t i;
+
+	if (!f || bayer)
+	{
+		fprintf (stderr, "Undistortion is not supported for the pixel format of %s\n", dev_name);
+		exit (EXIT_FAILURE);
+	}
+	remap_kernel = PIXELS_RGB == pixels ? f->rgb : f->gray;
+
+	mapoffset = new unsigned int[width * height];
+	mapfrac = new unsigned int[width * height];
+	for (row = 0, i = 0; row < height; row++)
+	{
+		for (col = 0; col < width; col++, i++)
+		{
+			x = (col - cx) / fx;
+			y = (row - cy) / fy;
+			r2 = x * x + y * y;
+			radial = 1 + r2 * (k1 + r2 * (k2 + r2 * k3));
+			u = fx * (x * radial + 2 * p1 * x * y + p2 * (r2 + 2 * x * x)) + cx;
+			v = fy * (y * radial + p1 * (r2 + 2 * y * y) + 2 * p2 * x * y) + cy;
+
+			// clamp to the frame; a fraction that rounds up to 256 moves on to the next sample,
+			// except on the last column and line, which are reached with a weight of 256
+			u = u < 0 ? 0 : (u > camWidth - 1 ? camWidth - 1 : u);
+			v = v < 0 ? 0 : (v > camHeight - 1 ? camHeight - 1 : v);
+			u0 = u < camWidth - 1 ? (int) u : camWidth - 2;
+			v0 = v < camHeight - 1 ? (int) v : camHeight - 2;
+			fu = (int) ((u - u0) * 256 + 0.5);
+			fv = (int) ((v - v0) * 256 + 0.5);
+			if (256 == fu && u0 < camWidth - 2)
+			{
+				u0++;
+				fu = 0;
+			}
+			if (256 == fv && v0 < camHeight - 2)
+			{
+				v0++;
+				fv = 0;
+			}
+
+			mapoffset[i] = v0 * bytesperline + u0 * f->step + f->y;
+			mapfrac[i] = fu | fv << 16;
+		}
+	}
+	fprintf (stdout, "Undistorting frames from %s\n", dev_name);
+}
+
+// remaps output rows row .. row + REMAP_TILE_H - 1, tile by tile so that the captured samples
+// a tile needs stay in cache
+void ofxV4L2::remap_band(const unsigned char * src, int row)
+{
+	int col, y, n, end = row + REMAP_TILE_H < height ? row + REMAP_TILE_H : height;
+	size_t i;
+
+	for (col = 0; col < width; col += REMAP_TILE_W)
+	{
+		n = col + REMAP_TILE_W < width ? REMAP_TILE_W : width - col;
+		for (y = row; y < end; y++)
+		{
+			i = (size_t) y * width + col;
+			remap_kernel (output + y * linesize + col * pixels, src, mapoffset + i, mapfrac + i, n, bytesperline);
+		}
+	}
+}
+
+// captured line k, unpacked to 8 bits; lines outside the frame are mirrored, which keeps the
+// colour pattern intact (as does the one sample of padding on either side)
+const unsigned char * ofxV4L2::bayer_line(const unsigned char * src, int k)
+{
+	unsigned char * line;
+	int slot, redrow, g0, g1;
+
+	if (k < 0)
+		k = -k;
+	else if (k >= camHeight)
+		k = 2 * camHeight - 2 - k;
+
+	slot = k % 3;
+	line = bayerlines + slot * (camWidth + 4) + 2;
+	if (bayertag[slot] == k)
+		return line;
+
+	// gains of the two colours on this line, for the even and the odd columns
+	redrow = (k & 1) == bayer->redy;
+	g0 = redrow ? bayergain[bayer->redx ? 1 : 0] : bayergain[bayer->redx ? 2 : 1];
+	g1 = redrow ? bayergain[bayer->redx ? 0 : 1] : bayergain[bayer->redx ? 1 : 2];
+	unpack (line, src + k * bytesperline, camWidth, g0, g1);
+	line[-1] = line[1];
+	line[camWidth] = line[camWidth - 2];
+	bayertag[slot] = k;
+	return line;
+}
+
+// demosaics output row 'row' of a Bayer frame
+void ofxV4L2::demosaic_line(unsigned char * dst, const unsigned char * src, int row)
+{
+	int redrow, greenfirst;
+
+	if (DEMOSAIC_HALF == demosaic)
+	{
+		demosaic_kernels[bayer->redx] (dst, bayer_line(src, 2 * row + bayer->redy), bayer_line(src, 2 * row + 1 - bayer->redy), NULL, width);
+		return;
+	}
+
+	redrow = (row & 1) == bayer->redy;
+	greenfirst = redrow ? bayer->redx : !bayer->redx;
+	demosaic_kernels[2 * redrow + greenfirst] (dst, bayer_line(src, row - 1), bayer_line(src, row), bayer_line(src, row + 1), width);
+}
+
+void ofxV4L2::process_image(const void * p, int length)
+{
+	int row;
+	double start = now_ms();
+	const unsigned char * src = (const unsigned char *) p;
+	unsigned char * dst, * second = NULL;
+	int parity = curfield;
+
+	// with field-rate output, the first field goes to the output frame, the second one to frames[fieldslot]
+	bool split = !bayer && !remap && fieldrate && !single_field(field) && V4L2_FIELD_NONE != field && DEINTERLACE_WEAVE != deinterlace;
+	if (split)
+		second = frames[fieldslot];
+
+	if (changedetect)
+		memset (tilesad, 0, tilesX * tilesY * sizeof (*tilesad));
+
+	if (bayer)
+	{
+		for (row = 0; row < 3; row++)
+		{
+			bayertag[row] = -1;
+			bayergain[row] = wbgain[row];
+		}
+	}
+
+	// convert line by line, so further processing of a line happens while it is still in cache
+	for (row=0; row<height; row++)
+	{
+		dst = output + row * linesize;
+		if (remap)
+		{
+			// the post-stages below then run on the lines of the band while they are in cache
+			if (0 == row % REMAP_TILE_H)
+				remap_band (src, row);
+		}
+		else if (bayer)
+			demosaic_line (dst, src, row);
+		else
+			kernel (dst, field_line(src, row, parity, linebuf), width);
+
+		if (denoise)
+			denoise_line(dst, row, 0);
+
+		if (split)
+		{
+			kernel (second + row * linesize, field_line(src, row, 1 - parity, linebuf), width);
+			// the filter state is per pixel, so filtering the second field right after the first keeps the time order
+			if (denoise)
+				denoise_line(second + row * linesize, row, 1);
+		}
+
+		if (changedetect && !(row & 1))
+			detect_changes(dst, row);
+	}
+
+	if (changedetect)
+		finish_change_detection();
+	info[back].changed = framechanged;
+
+	if (denoise)
+		next_denoise_frame(split ? 2 : 1);
+
+	framestats.frames++;
+	framestats.process_last = now_ms() - start;
+	info[back].process_time = framestats.process_last;
+	framestats.process_total += framestats.process_last;
+	if (framestats.process_last > framestats.process_max)
+		framestats.process_max = framestats.process_last;
+
+	if (split)
+	{
+		info[back].field = parity ? V4L2_FIELD_BOTTOM : V4L2_FIELD_TOP;
+		info[fieldslot] = info[back];
+		info[fieldslot].field = parity ? V4L2_FIELD_TOP : V4L2_FIELD_BOTTOM;
+		if (changedetect)
+			memcpy (changedtiles + fieldslot * tilesX * tilesY, changedtiles + back * tilesX * tilesY, tilesX * tilesY);
+		fieldpending = true;
+	}
+}
+
+void ofxV4L2::grabFrame(void)
+{
+	// the time the application spent on the previous frame
+	TRACE_FRAME(consumer_trace, "application", info[front].sequence);
+	TRACE_BEGIN(t);
+
+	grab_frame();
+
+	TRACE_FRAME(t, "grabFrame", info[front].sequence);
+	TRACE_RESTART(consumer_trace);
+}
+
+void ofxV4L2::grab_frame(void)
 {
-	int row, col;
-	unsigned char * y = p;
-	for (row=0; row<camHeight; row++)
+	int r;
+
+	if (fieldpending && !realtime)
+	{
+		// the second field of the last buffer is waiting in frames[fieldslot]
+		r = front;
+		front = back = fieldslot;
+		fieldslot = r;
+		output = frames[back];
+		fieldpending = false;
+		newframe = true;
+		return;
+	}
+
+	if (realtime)
 	{
-		for (col=0; col<camWidth; col++)
+		// the capture thread keeps converting; show the second field of the last pair first,
+		// then pick up the newest pair if there is one
+		if (apppending)
+		{
+			r = front;
+			front = appfield;
+			appfield = r;
+			apppending = false;
+			newframe = true;
+		}
+		else if (ready.load() & FRAME_FRESH)
 		{
-			 image[col + row * camWidth] = *(y + 2*(col + (row*camWidth)));
+			r = ready.exchange(front | appfield << 3);
+			front = r & 7;
+			appfield = (r >> 3) & 7;
+			apppending = r & FRAME_PAIR;
+			newframe = true;
+			// a snapshot taken before the last resetStats() was carried out is stale
+			if (slotreset[front] == statsreset.load())
+				appstats = slotstats[front];
 		}
+		else
+		{
+			newframe = false;
+		}
+		return;
 	}
+
+	newframe = read_frame(2000);
 }
 
-void ofxV4L2::grabFrame(void)
+// waits at most timeout ms for a frame, dequeues and converts it
+// returns true if a frame was converted
+bool ofxV4L2::read_frame(int timeout)
 {
     struct v4l2_buffer buf;
     unsigned int i;
 
-	// what is this?
 	fd_set fds;
 	struct timeval tv;
 	int r;
 
-	// and this?
+	// wait until the device has a frame ready
 	FD_ZERO (&fds);
 	FD_SET (fd, &fds);
 
-	/* Timeout. */
-	tv.tv_sec = 2;
-	tv.tv_usec = 0;
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
 
-	// and this?
-	// what does this do? outcome: app exits cause r == 0
+	TRACE_BEGIN(t);
 	r = select (fd + 1, &fds, NULL, NULL, &tv);
-	r = 1;
+	TRACE_END(t, "select");
 
 	if (-1 == r)
 	{
 		if (EINTR == errno)
-			return 0;
+			return false;
 		errno_exit ("select");
 	}
 
-	if (0 == r)
-	{
-		fprintf (stderr, "select timeout\n");
-		exit (EXIT_FAILURE);
-	}
+	// on a timeout the dequeue below simply finds no frame (EAGAIN)
 
     switch (io)
     {
         case IO_METHOD_READ:
+            TRACE_RESTART(t);
             if (-1 == read (fd, buffers[0].start, buffers[0].length))
             {
                 switch (errno)
                 {
                     case EAGAIN:
-                        return 0;
+                        framestats.missed++;
+                        return false;
                     case EIO:
                         /* Could ignore EIO, see spec. */
                         /* fall through */
@@ -185,7 +1016,16 @@ void ofxV4L2::grabFrame(void)
                 }
             }
 
+            begin_frame (NULL);
+            TRACE_FRAME(t, "read", info[back].sequence);
+            TRACE_RESTART(t);
             process_image (buffers[0].start, buffers[0].length);
+            TRACE_FRAME(t, "process_image", info[back].sequence);
+            TRACE_RESTART(t);
+            serve_frame (buffers[0].start, buffers[0].length);
+            record_frame (buffers[0].start, buffers[0].length);
+            output_frame (buffers[0].start, buffers[0].length);
+            TRACE_FRAME(t, "serve/record/output", info[back].sequence);
             break;
 
         case IO_METHOD_MMAP:
@@ -194,13 +1034,14 @@ void ofxV4L2::grabFrame(void)
             buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
             buf.memory = V4L2_MEMORY_MMAP;
 
+            TRACE_RESTART(t);
             if (-1 == xioctl (fd, VIDIOC_DQBUF, &buf))
             {
                 switch (errno)
                 {
                     case EAGAIN:
-						newframe = false;
-                        return 0;
+                        framestats.missed++;
+                        return false;
                     case EIO:
                         /* Could ignore EIO, see spec. */
                         /* fall through */
@@ -210,12 +1051,23 @@ void ofxV4L2::grabFrame(void)
             }
 
             assert (buf.index < n_buffers);
-
-            process_image(buffers[buf.index].start, buffers[0].length);
-            newframe = true;
-
+            TRACE_FRAME(t, "VIDIOC_DQBUF", buf.sequence);
+
+            TRACE_RESTART(t);
+            begin_frame(&buf);
+            process_image(buffers[buf.index].start, buf.bytesused);
+            update_latency(buf);
+            TRACE_FRAME(t, "process_image", buf.sequence);
+            TRACE_RESTART(t);
+            serve_frame(buffers[buf.index].start, buf.bytesused);
+            record_frame(buffers[buf.index].start, buf.bytesused);
+            output_frame(buffers[buf.index].start, buf.bytesused);
+            TRACE_FRAME(t, "serve/record/output", buf.sequence);
+
+            TRACE_RESTART(t);
             if (-1 == xioctl (fd, VIDIOC_QBUF, &buf))
                 errno_exit ("VIDIOC_QBUF");
+            TRACE_FRAME(t, "VIDIOC_QBUF", buf.sequence);
 
             break;
 
@@ -224,12 +1076,14 @@ void ofxV4L2::grabFrame(void)
 
             buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
             buf.memory = V4L2_MEMORY_USERPTR;
+            TRACE_RESTART(t);
             if (-1 == xioctl (fd, VIDIOC_DQBUF, &buf))
             {
                 switch (errno)
                 {
                     case EAGAIN:
-                        return 0;
+                        framestats.missed++;
+                        return false;
 
                     case EIO:
                         /* Could ignore EIO, see spec. */
@@ -245,14 +1099,356 @@ void ofxV4L2::grabFrame(void)
                     break;
 
             assert (i < n_buffers);
-
-            process_image ((void *) buf.m.userptr, buf.length);
-
+            TRACE_FRAME(t, "VIDIOC_DQBUF", buf.sequence);
+
+            TRACE_RESTART(t);
+            begin_frame(&buf);
+            process_image ((void *) buf.m.userptr, buf.bytesused);
+            update_latency(buf);
+            TRACE_FRAME(t, "process_image", buf.sequence);
+            TRACE_RESTART(t);
+            serve_frame ((void *) buf.m.userptr, buf.bytesused);
+            record_frame ((void *) buf.m.userptr, buf.bytesused);
+            output_frame ((void *) buf.m.userptr, buf.bytesused);
+            TRACE_FRAME(t, "serve/record/output", buf.sequence);
+
+            TRACE_RESTART(t);
             if (-1 == xioctl (fd, VIDIOC_QBUF, &buf))
                     errno_exit ("VIDIOC_QBUF");
+            TRACE_FRAME(t, "VIDIOC_QBUF", buf.sequence);
 
             break;
     }
+
+    return true;
+}
+
+// fills the metadata of the frame about to be converted
+// buf is NULL for read i/o, which has no v4l2_buffer
+void ofxV4L2::begin_frame(const struct v4l2_buffer * buf)
+{
+	frameinfo & fi = info[back];
+
+	fi.dequeued = now_ms();
+	fi.exposure = exposure;
+	fi.gain = gain;
+	fi.autogain = autogain;
+	fi.has_meta = false;
+	fi.field = field;
+	curfield = firstfield;
+	if (buf)
+	{
+		if (V4L2_FIELD_ALTERNATE == field)
+		{
+			fi.field = buf->field;
+			curfield = V4L2_FIELD_BOTTOM == buf->field;
+		}
+		fi.sequence = buf->sequence;
+		fi.timestamp = buf->timestamp;
+		fi.tsflags = buf->flags & (V4L2_BUF_FLAG_TIMESTAMP_MASK | V4L2_BUF_FLAG_TSTAMP_SRC_MASK);
+		if (meta_fd != -1)
+			read_meta(fi);
+	}
+	else
+	{
+		fi.sequence = framestats.frames;
+		gettimeofday(&fi.timestamp, NULL);
+		fi.tsflags = V4L2_BUF_FLAG_TIMESTAMP_UNKNOWN;
+	}
+}
+
+// time between the kernel timestamp of a buffer and the converted frame being available
+void ofxV4L2::update_latency(const struct v4l2_buffer & buf)
+{
+	if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+		return;
+
+	framestats.latency_last = now_ms() - (buf.timestamp.tv_sec * 1000.0 + buf.timestamp.tv_usec / 1000.0);
+	if (framestats.latency_last > framestats.latency_max)
+		framestats.latency_max = framestats.latency_last;
+}
+
+// opens and starts streaming the metadata node (V4L2_BUF_TYPE_META_CAPTURE) that belongs
+// to the video device, e.g. the second node a UVC camera exposes
+void ofxV4L2::init_meta(void)
+{
+    struct v4l2_capability cap;
+    struct v4l2_requestbuffers req;
+    struct v4l2_buffer buf;
+    enum v4l2_buf_type type;
+
+    meta_fd = open (meta_name, O_RDWR | O_NONBLOCK, 0);
+    if (-1 == meta_fd)
+    {
+        fprintf (stderr, "Cannot open '%s': %d, %s\n", meta_name, errno, strerror (errno));
+        exit (EXIT_FAILURE);
+    }
+
+    if (-1 == xioctl (meta_fd, VIDIOC_QUERYCAP, &cap))
+        errno_exit ("VIDIOC_QUERYCAP");
+
+    if (!(cap.device_caps & V4L2_CAP_META_CAPTURE) || !(cap.device_caps & V4L2_CAP_STREAMING))
+    {
+        fprintf (stderr, "%s is no streaming metadata capture device\n", meta_name);
+        exit (EXIT_FAILURE);
+    }
+
+    CLEAR (req);
+    req.count               = META_BUFFERS;
+    req.type                = V4L2_BUF_TYPE_META_CAPTURE;
+    req.memory              = V4L2_MEMORY_MMAP;
+
+    if (-1 == xioctl (meta_fd, VIDIOC_REQBUFS, &req))
+        errno_exit ("VIDIOC_REQBUFS");
+
+    for (n_meta = 0; n_meta < req.count && n_meta < META_BUFFERS; ++n_meta)
+    {
+        CLEAR (buf);
+        buf.type        = V4L2_BUF_TYPE_META_CAPTURE;
+        buf.memory      = V4L2_MEMORY_MMAP;
+        buf.index       = n_meta;
+
+        if (-1 == xioctl (meta_fd, VIDIOC_QUERYBUF, &buf))
+            errno_exit ("VIDIOC_QUERYBUF");
+
+        meta_buffers[n_meta].length = buf.length;
+        meta_buffers[n_meta].start = mmap (NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, meta_fd, buf.m.offset);
+
+        if (MAP_FAILED == meta_buffers[n_meta].start)
+            errno_exit ("mmap");
+
+        lock_memory (meta_buffers[n_meta].start, buf.length);
+
+        if (-1 == xioctl (meta_fd, VIDIOC_QBUF, &buf))
+            errno_exit ("VIDIOC_QBUF");
+    }
+
+    type = V4L2_BUF_TYPE_META_CAPTURE;
+    if (-1 == xioctl (meta_fd, VIDIOC_STREAMON, &type))
+        errno_exit ("VIDIOC_STREAMON");
+
+    fprintf (stdout, "Opened metadata device: %s\n", meta_name);
+}
+
+void ofxV4L2::uninit_meta(void)
+{
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_META_CAPTURE;
+    unsigned int i;
+
+    if (-1 == xioctl (meta_fd, VIDIOC_STREAMOFF, &type))
+        errno_exit ("VIDIOC_STREAMOFF");
+
+    for (i = 0; i < n_meta; ++i)
+        if (-1 == munmap (meta_buffers[i].start, meta_buffers[i].length))
+            errno_exit ("munmap");
+
+    close (meta_fd);
+    meta_fd = -1;
+}
+
+// pairs the metadata buffer with the same sequence number to the frame
+// metadata buffers of older frames are dropped, one of a newer frame is kept for the next frame
+void ofxV4L2::read_meta(frameinfo & fi)
+{
+    for (;;)
+    {
+        if (!meta_held)
+        {
+            CLEAR (meta_buf);
+            meta_buf.type = V4L2_BUF_TYPE_META_CAPTURE;
+            meta_buf.memory = V4L2_MEMORY_MMAP;
+
+            if (-1 == xioctl (meta_fd, VIDIOC_DQBUF, &meta_buf))
+            {
+                if (EAGAIN == errno)
+                    return;
+                errno_exit ("VIDIOC_DQBUF");
+            }
+            meta_held = true;
+        }
+
+        // a newer frame's metadata: keep it dequeued until that frame arrives
+        if (meta_buf.sequence > fi.sequence)
+            return;
+
+        if (meta_buf.sequence == fi.sequence)
+        {
+            fi.has_meta = true;
+            fi.meta_length = meta_buf.bytesused < META_MAX ? meta_buf.bytesused : META_MAX;
+            memcpy (fi.meta, meta_buffers[meta_buf.index].start, fi.meta_length);
+        }
+
+        meta_held = false;
+        if (-1 == xioctl (meta_fd, VIDIOC_QBUF, &meta_buf))
+            errno_exit ("VIDIOC_QBUF");
+
+        if (fi.has_meta)
+            return;
+    }
+}
+
+// hands the frame (and the second field in field-rate mode) to the frame server
+void ofxV4L2::serve_frame(const void * p, unsigned int length)
+{
+	if (!server)
+		return;
+
+	if (serve_raw)
+	{
+		server->publish(p, length, info[back]);
+		return;
+	}
+
+	server->publish(output, framesize, info[back]);
+	if (fieldpending)
+		server->publish(frames[fieldslot], framesize, info[fieldslot]);
+}
+
+// queues the frame (and the second field in field-rate mode) for the recorder
+void ofxV4L2::record_frame(const void * p, unsigned int length)
+{
+	if (!recorder->isRecording())
+		return;
+
+	if (record_raw)
+	{
+		// a short buffer would make the recorder read past its end
+		if (length >= imagesize)
+			recorder->addFrame(p, info[back]);
+		return;
+	}
+
+	recorder->addFrame(output, info[back]);
+	if (fieldpending)
+		recorder->addFrame(frames[fieldslot], info[fieldslot]);
+}
+
+// passes the frame on to the output device set with setOutput()
+// the raw buffer goes through unconverted when the sink uses the capture format and line layout
+void ofxV4L2::output_frame(const void * p, unsigned int length)
+{
+	if (!sink)
+		return;
+
+	if (sink->pixelformat == pixelformat && sink->imagesize <= length && sink->bytesperline == bytesperline
+		&& sink->camWidth == camWidth && sink->camHeight == camHeight)
+	{
+		sink->putFrame(p, sink->imagesize, 0);
+		return;
+	}
+
+	if (sink->pixelformat != pixels_fourcc())
+		return;
+
+	sink->putFrame(output, framesize, 0);
+	if (fieldpending)
+		sink->putFrame(frames[fieldslot], framesize, 0);
+}
+
+void * ofxV4L2::capture_thread(void * arg)
+{
+	pthread_setname_np (pthread_self (), "ofxV4L2 capture");
+	((ofxV4L2 *) arg)->capture_loop();
+	return NULL;
+}
+
+// body of the real-time capture thread: convert into the back frame (and the second field into
+// frames[fieldslot]), then hand both over at once, so the app gets the fields in order
+void ofxV4L2::capture_loop(void)
+{
+	int r;
+
+	while (running.load())
+	{
+		if (statsseen != statsreset.load())
+		{
+			statsseen = statsreset.load();
+			CLEAR (framestats);
+		}
+
+		if (!read_frame(100))
+			continue;
+
+		slotstats[back] = framestats;
+		slotreset[back] = statsseen;
+		r = ready.exchange(back | fieldslot << 3 | FRAME_FRESH | (fieldpending ? FRAME_PAIR : 0));
+		back = r & 7;
+		fieldslot = (r >> 3) & 7;
+		output = frames[back];
+		fieldpending = false;
+	}
+}
+
+void ofxV4L2::start_thread(void)
+{
+	pthread_attr_t attr;
+	struct sched_param param;
+	cpu_set_t cpus;
+	int r;
+
+	running = true;
+	pthread_attr_init (&attr);
+	if (rtpriority > 0)
+	{
+		pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy (&attr, SCHED_FIFO);
+		param.sched_priority = rtpriority;
+		pthread_attr_setschedparam (&attr, &param);
+	}
+	// pinned from the start, so the thread never runs on another cpu
+	if (rtcpu >= 0)
+	{
+		CPU_ZERO (&cpus);
+		CPU_SET (rtcpu, &cpus);
+		pthread_attr_setaffinity_np (&attr, sizeof (cpus), &cpus);
+	}
+
+	r = pthread_create (&thread, &attr, capture_thread, this);
+	if (EINVAL == r && rtcpu >= 0)
+	{
+		// the cpu does not exist or is not allowed for this process
+		fprintf (stderr, "Cannot pin capture thread of %s to cpu %d: %s\n", dev_name, rtcpu, strerror (r));
+		if (0 == sched_getaffinity (0, sizeof (cpus), &cpus))
+			pthread_attr_setaffinity_np (&attr, sizeof (cpus), &cpus);
+		r = pthread_create (&thread, &attr, capture_thread, this);
+	}
+	if (EPERM == r)
+	{
+		// usually means no CAP_SYS_NICE / rtprio limit: run with the default scheduler instead
+		fprintf (stderr, "No permission for SCHED_FIFO priority %d on %s, using the default scheduler\n", rtpriority, dev_name);
+		pthread_attr_setinheritsched (&attr, PTHREAD_INHERIT_SCHED);
+		r = pthread_create (&thread, &attr, capture_thread, this);
+	}
+	pthread_attr_destroy (&attr);
+
+	if (0 != r)
+	{
+		errno = r;
+		errno_exit ("pthread_create");
+	}
+}
+
+void ofxV4L2::stop_thread(void)
+{
+	running = false;
+	pthread_join (thread, NULL);
+}
+
+// locks a buffer in memory (if real-time capture is used) and touches every page of it,
+// so capturing does not run into page faults
+void ofxV4L2::lock_memory(void * start, size_t length)
+{
+	volatile unsigned char * p = (volatile unsigned char *) start;
+	size_t i, page_size = getpagesize ();
+
+	if (!realtime || !start)
+		return;
+
+	if (-1 == mlock (start, length))
+		fprintf (stderr, "Cannot lock %lu bytes of buffer memory: %s\n", (unsigned long) length, strerror (errno));
+
+	for (i = 0; i < length; i += page_size)
+		p[i] = p[i];
 }
 
 void ofxV4L2::stop_capturing (void)
@@ -266,7 +1462,7 @@ void ofxV4L2::stop_capturing (void)
 
     case IO_METHOD_MMAP:
     case IO_METHOD_USERPTR:
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        type = buftype;
 
         if (-1 == xioctl (fd, VIDIOC_STREAMOFF, &type))
                 errno_exit ("VIDIOC_STREAMOFF");
@@ -279,6 +1475,42 @@ void ofxV4L2::start_capturing(void)
 {
     unsigned int i;
     enum v4l2_buf_type type;
+    TRACE_BEGIN(all);
+    TRACE_BEGIN(t);
+
+    // pre-fault the output frames before the first frame arrives
+    for (i = 0; i < N_FRAMES; ++i)
+        lock_memory (frames[i], framesize);
+    lock_memory (linebuf, bytesperline);
+    if (bayer)
+        lock_memory (bayerlines, 3 * (camWidth + 4));
+    if (remap)
+    {
+        lock_memory (mapoffset, (size_t) width * height * sizeof (*mapoffset));
+        lock_memory (mapfrac, (size_t) width * height * sizeof (*mapfrac));
+    }
+    if (denoise)
+        lock_memory (denoise_acc, framesize * sizeof (*denoise_acc));
+    if (DENOISE_STACK == denoise)
+        lock_memory (denoise_ring, framesize * denoise_frames);
+    if (changedetect)
+    {
+        lock_memory (changeref, ((width + 1) / 2) * ((height + 1) / 2));
+        lock_memory (tilesad, tilesX * tilesY * sizeof (*tilesad));
+        lock_memory (tilelimit, tilesX * tilesY * sizeof (*tilelimit));
+        lock_memory (changedtiles, N_FRAMES * tilesX * tilesY);
+    }
+    TRACE_END(t, "lock_memory");
+
+    // output buffers are queued by putFrame() once they are filled
+    if (V4L2_BUF_TYPE_VIDEO_OUTPUT == buftype && IO_METHOD_READ != io)
+    {
+        type = buftype;
+        if (-1 == xioctl (fd, VIDIOC_STREAMON, &type))
+            errno_exit ("VIDIOC_STREAMON");
+        TRACE_END(all, "start_capturing");
+        return;
+    }
 
     switch (io)
     {
@@ -287,35 +1519,40 @@ void ofxV4L2::start_capturing(void)
                 break;
 
         case IO_METHOD_MMAP:
+            TRACE_RESTART(t);
             for (i = 0; i < n_buffers; ++i)
             {
                 struct v4l2_buffer buf;
 
                 CLEAR (buf);
 
-                buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                buf.type        = buftype;
                 buf.memory      = V4L2_MEMORY_MMAP;
                 buf.index       = i;
 
                 if (-1 == xioctl (fd, VIDIOC_QBUF, &buf))
                     errno_exit ("VIDIOC_QBUF");
             }
+            TRACE_END(t, "VIDIOC_QBUF");
 
-            type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            type = buftype;
 
+            TRACE_RESTART(t);
             if (-1 == xioctl (fd, VIDIOC_STREAMON, &type))
                     errno_exit ("VIDIOC_STREAMON");
+            TRACE_END(t, "VIDIOC_STREAMON");
 
             break;
 
         case IO_METHOD_USERPTR:
+            TRACE_RESTART(t);
             for (i = 0; i < n_buffers; ++i)
             {
                 struct v4l2_buffer buf;
 
                 CLEAR (buf);
 
-                buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                buf.type        = buftype;
                 buf.memory      = V4L2_MEMORY_USERPTR;
                 buf.index       = i;
                 buf.m.userptr   = (unsigned long) buffers[i].start;
@@ -324,14 +1561,18 @@ void ofxV4L2::start_capturing(void)
                 if (-1 == xioctl (fd, VIDIOC_QBUF, &buf))
                     errno_exit ("VIDIOC_QBUF");
             }
+            TRACE_END(t, "VIDIOC_QBUF");
 
-            type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            type = buftype;
 
+            TRACE_RESTART(t);
             if (-1 == xioctl (fd, VIDIOC_STREAMON, &type))
                 errno_exit ("VIDIOC_STREAMON");
+            TRACE_END(t, "VIDIOC_STREAMON");
 
             break;
     }
+    TRACE_END(all, "start_capturing");
 }
 
 void ofxV4L2::uninit_device(void)
@@ -348,7 +1589,7 @@ void ofxV4L2::uninit_device(void)
             for (i = 0; i < n_buffers; ++i)
                 if (-1 == munmap (buffers[i].start, buffers[i].length))
                     errno_exit ("munmap");
-                break;
+            break;
 
         case IO_METHOD_USERPTR:
             for (i = 0; i < n_buffers; ++i)
@@ -361,7 +1602,7 @@ void ofxV4L2::uninit_device(void)
 
 void ofxV4L2::init_read(unsigned int buffer_size)
 {
-    buffers = calloc (1, sizeof (*buffers));
+    buffers = (struct buffer *) calloc (1, sizeof (*buffers));
 
     if (!buffers) {
         fprintf (stderr, "Out of memory\n");
@@ -375,6 +1616,8 @@ void ofxV4L2::init_read(unsigned int buffer_size)
         fprintf (stderr, "Out of memory\n");
         exit (EXIT_FAILURE);
     }
+
+    lock_memory (buffers[0].start, buffer_size);
 }
 
 void ofxV4L2::init_mmap(void)
@@ -384,7 +1627,7 @@ void ofxV4L2::init_mmap(void)
     CLEAR (req);
 
     req.count               = 4;
-    req.type                = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.type                = buftype;
     req.memory              = V4L2_MEMORY_MMAP;
 
     if (-1 == xioctl (fd, VIDIOC_REQBUFS, &req))
@@ -407,7 +1650,7 @@ void ofxV4L2::init_mmap(void)
         exit (EXIT_FAILURE);
     }
 
-    buffers = calloc (req.count, sizeof (*buffers));
+    buffers = (struct buffer *) calloc (req.count, sizeof (*buffers));
 
     if (!buffers)
     {
@@ -421,7 +1664,7 @@ void ofxV4L2::init_mmap(void)
 
         CLEAR (buf);
 
-        buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.type        = buftype;
         buf.memory      = V4L2_MEMORY_MMAP;
         buf.index       = n_buffers;
 
@@ -438,6 +1681,8 @@ void ofxV4L2::init_mmap(void)
 
         if (MAP_FAILED == buffers[n_buffers].start)
             errno_exit ("mmap");
+
+        lock_memory (buffers[n_buffers].start, buf.length);
     }
 }
 
@@ -452,7 +1697,7 @@ void ofxV4L2::init_userp(unsigned int buffer_size)
     CLEAR (req);
 
     req.count               = 4;
-    req.type                = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.type                = buftype;
     req.memory              = V4L2_MEMORY_USERPTR;
 
     if (-1 == xioctl (fd, VIDIOC_REQBUFS, &req))
@@ -468,7 +1713,7 @@ void ofxV4L2::init_userp(unsigned int buffer_size)
         }
     }
 
-    buffers = calloc (4, sizeof (*buffers));
+    buffers = (struct buffer *) calloc (4, sizeof (*buffers));
 
     if (!buffers) {
             fprintf (stderr, "Out of memory\n");
@@ -484,16 +1729,50 @@ void ofxV4L2::init_userp(unsigned int buffer_size)
                     fprintf (stderr, "Out of memory\n");
                     exit (EXIT_FAILURE);
             }
+
+            lock_memory (buffers[n_buffers].start, buffer_size);
     }
 }
 
+// bytes per pixel of the packed formats (of a captured line, or of what an output device is fed with)
+static unsigned int bytes_per_pixel(unsigned int pixelformat)
+{
+	switch (pixelformat)
+	{
+		case V4L2_PIX_FMT_GREY:
+		case V4L2_PIX_FMT_SBGGR8:
+		case V4L2_PIX_FMT_SGBRG8:
+		case V4L2_PIX_FMT_SGRBG8:
+		case V4L2_PIX_FMT_SRGGB8:
+			return 1;
+		case V4L2_PIX_FMT_RGB24:
+		case V4L2_PIX_FMT_BGR24:
+			return 3;
+		case V4L2_PIX_FMT_RGB32:
+		case V4L2_PIX_FMT_BGR32:
+			return 4;
+		default:
+			return 2;	// YUYV, UYVY, Bayer formats of more than 8 bits, ...
+	}
+}
+
+// bytes of a line without padding; the packed Bayer formats take less than a byte per sample
+static unsigned int line_bytes(unsigned int pixelformat, int width)
+{
+	const ofxV4L2BayerFormat * b = ofxV4L2FindBayer(pixelformat);
+
+	return b ? ofxV4L2BayerLineBytes(b, width) : width * bytes_per_pixel(pixelformat);
+}
+
 void ofxV4L2::init_device(void)
 {
     struct v4l2_capability cap;
     struct v4l2_cropcap cropcap;
     struct v4l2_crop crop;
     struct v4l2_format fmt;
+    v4l2_std_id std;
     unsigned int min;
+    TRACE_BEGIN(all);
 
     if (-1 == xioctl (fd, VIDIOC_QUERYCAP, &cap))
     {
@@ -602,22 +1881,39 @@ void ofxV4L2::init_device(void)
     fmt.type                = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     fmt.fmt.pix.width       = camWidth;
     fmt.fmt.pix.height      = camHeight;
-    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
-    fmt.fmt.pix.field       = V4L2_FIELD_INTERLACED;
+    fmt.fmt.pix.pixelformat = capture_format;
+    fmt.fmt.pix.field       = bayer ? V4L2_FIELD_NONE : V4L2_FIELD_INTERLACED;
 
+    TRACE_BEGIN(t);
     if (-1 == xioctl (fd, VIDIOC_S_FMT, &fmt))
             errno_exit ("VIDIOC_S_FMT");
+    TRACE_END(t, "VIDIOC_S_FMT");
 
     /* Note VIDIOC_S_FMT may change width and height. */
 
     /* Buggy driver paranoia. */
-    min = fmt.fmt.pix.width * 2;
+    min = line_bytes(fmt.fmt.pix.pixelformat, fmt.fmt.pix.width);
     if (fmt.fmt.pix.bytesperline < min)
         fmt.fmt.pix.bytesperline = min;
     min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
     if (fmt.fmt.pix.sizeimage < min)
         fmt.fmt.pix.sizeimage = min;
 
+    bytesperline = fmt.fmt.pix.bytesperline;
+    imagesize = fmt.fmt.pix.sizeimage;
+    pixelformat = fmt.fmt.pix.pixelformat;
+
+    // the driver may not support the requested field order; work with the one it returned
+    field = fmt.fmt.pix.field;
+    firstfield = V4L2_FIELD_INTERLACED_BT == field || V4L2_FIELD_SEQ_BT == field || V4L2_FIELD_BOTTOM == field;
+    // with V4L2_FIELD_INTERLACED the field order follows the standard: bottom first for 525 line video (NTSC)
+    if (V4L2_FIELD_INTERLACED == field && 0 == xioctl (fd, VIDIOC_G_STD, &std)
+        && (std & V4L2_STD_525_60) && !(std & V4L2_STD_625_50))
+        firstfield = 1;
+    if (V4L2_FIELD_NONE != field && V4L2_FIELD_ANY != field)
+        fprintf (stdout, "Device %s delivers interlaced video (v4l2 field %d)\n", dev_name, field);
+
+    TRACE_RESTART(t);
     switch (io)
     {
         case IO_METHOD_READ:
@@ -632,6 +1928,177 @@ void ofxV4L2::init_device(void)
             init_userp (fmt.fmt.pix.sizeimage);
             break;
     }
+    TRACE_END(t, "allocate buffers");
+    TRACE_END(all, "init_device");
+}
+
+void ofxV4L2::initSynthetic(int cw, int ch, unsigned int format, unsigned int stride)
+{
+	io = IO_METHOD_READ;
+	dev_name = "synthetic source";
+	realtime = false;
+	capture_format = format;
+	init_frames(cw, ch);
+
+	pixelformat = format;
+	field = V4L2_FIELD_NONE;
+	firstfield = 0;
+	bytesperline = stride ? stride : line_bytes(format, cw);
+	imagesize = bytesperline * ch;
+	init_processing();
+}
+
+void ofxV4L2::feedFrame(const void * data, unsigned int length)
+{
+	TRACE_BEGIN(t);
+	begin_frame(NULL);
+	process_image(data, length);
+	serve_frame(data, length);
+	record_frame(data, length);
+	output_frame(data, length);
+	TRACE_FRAME(t, "feedFrame", info[back].sequence);
+	newframe = true;
+}
+
+void ofxV4L2::initOutput(const char * devname, int iomethod, int cw, int ch, unsigned int format)
+{
+	io = iomethod;
+	camWidth = cw;
+	camHeight = ch;
+	buftype = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	out_next = 0;
+
+	open_device(devname);
+	init_output_device(format);
+	start_capturing();
+}
+
+// output counterpart of init_device()
+void ofxV4L2::init_output_device(unsigned int format)
+{
+    struct v4l2_capability cap;
+    struct v4l2_format fmt;
+    unsigned int caps;
+
+    if (-1 == xioctl (fd, VIDIOC_QUERYCAP, &cap))
+        errno_exit ("VIDIOC_QUERYCAP");
+
+    caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities;
+    if (!(caps & V4L2_CAP_VIDEO_OUTPUT))
+    {
+        fprintf (stderr, "%s is no video output device\n", dev_name);
+        exit (EXIT_FAILURE);
+    }
+
+    if (!(caps & (IO_METHOD_READ == io ? V4L2_CAP_READWRITE : V4L2_CAP_STREAMING)))
+    {
+        fprintf (stderr, "%s does not support %s i/o\n", dev_name, IO_METHOD_READ == io ? "write" : "streaming");
+        exit (EXIT_FAILURE);
+    }
+
+    CLEAR (fmt);
+
+    fmt.type                = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    fmt.fmt.pix.width       = camWidth;
+    fmt.fmt.pix.height      = camHeight;
+    fmt.fmt.pix.pixelformat = format;
+    fmt.fmt.pix.field       = V4L2_FIELD_NONE;
+    fmt.fmt.pix.bytesperline = line_bytes(format, camWidth);
+    fmt.fmt.pix.sizeimage   = fmt.fmt.pix.bytesperline * camHeight;
+
+    if (-1 == xioctl (fd, VIDIOC_S_FMT, &fmt))
+        errno_exit ("VIDIOC_S_FMT");
+
+    if (fmt.fmt.pix.pixelformat != format || (int) fmt.fmt.pix.width != camWidth || (int) fmt.fmt.pix.height != camHeight)
+    {
+        fprintf (stderr, "%s does not accept %dx%d frames in the requested format\n", dev_name, camWidth, camHeight);
+        exit (EXIT_FAILURE);
+    }
+
+    bytesperline = fmt.fmt.pix.bytesperline;
+    imagesize = fmt.fmt.pix.sizeimage;
+    pixelformat = fmt.fmt.pix.pixelformat;
+    field = V4L2_FIELD_NONE;
+
+    switch (io)
+    {
+        case IO_METHOD_READ:
+            init_read (imagesize);
+            break;
+
+        case IO_METHOD_MMAP:
+            init_mmap ();
+            break;
+
+        case IO_METHOD_USERPTR:
+            init_userp (imagesize);
+            break;
+    }
+}
+
+bool ofxV4L2::putFrame(const void * data, unsigned int length, int timeout)
+{
+    struct v4l2_buffer buf;
+    fd_set fds;
+    struct timeval tv;
+
+    if (IO_METHOD_READ == io)
+        return -1 != write (fd, data, length);
+
+    CLEAR (buf);
+    buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    buf.memory = IO_METHOD_MMAP == io ? V4L2_MEMORY_MMAP : V4L2_MEMORY_USERPTR;
+
+    if (out_next < n_buffers)
+    {
+        // buffers that were never queued are free
+        buf.index = out_next++;
+    }
+    else
+    {
+        // wait for the device to give back a buffer
+        FD_ZERO (&fds);
+        FD_SET (fd, &fds);
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        if (-1 == select (fd + 1, NULL, &fds, NULL, &tv) && EINTR != errno)
+            errno_exit ("select");
+
+        if (-1 == xioctl (fd, VIDIOC_DQBUF, &buf))
+        {
+            if (EAGAIN == errno)
+            {
+                framestats.missed++;
+                return false;
+            }
+            errno_exit ("VIDIOC_DQBUF");
+        }
+    }
+
+    assert (buf.index < n_buffers);
+
+    if (length > buffers[buf.index].length)
+        length = buffers[buf.index].length;
+    memcpy (buffers[buf.index].start, data, length);
+
+    buf.bytesused = length;
+    buf.field = V4L2_FIELD_NONE;
+    if (IO_METHOD_USERPTR == io)
+    {
+        buf.m.userptr = (unsigned long) buffers[buf.index].start;
+        buf.length = buffers[buf.index].length;
+    }
+
+    if (-1 == xioctl (fd, VIDIOC_QBUF, &buf))
+        errno_exit ("VIDIOC_QBUF");
+
+    framestats.frames++;
+    return true;
+}
+
+void ofxV4L2::setOutput(ofxV4L2 * output_device)
+{
+	sink = output_device;
 }
 
 void ofxV4L2::close_device(void)
@@ -669,7 +2136,29 @@ void ofxV4L2::open_device(const char * devname)
 
 ofxV4L2::~ofxV4L2()
 {
-	stop_capturing();
-	uninit_device();
-	close_device();
+	if (running)
+		stop_thread();
+	if (meta_fd != -1)
+		uninit_meta();
+	if (fd != -1)
+	{
+		stop_capturing();
+		uninit_device();
+		close_device();
+	}
+
+	for (int i = 0; i < N_FRAMES; i++)
+		delete [] frames[i];
+	delete [] linebuf;
+	delete [] bayerlines;
+	delete [] mapoffset;
+	delete [] mapfrac;
+	delete server;
+	delete recorder;
+	delete [] changeref;
+	delete [] tilesad;
+	delete [] tilelimit;
+	delete [] changedtiles;
+	free (denoise_acc);
+	free (denoise_ring);
 }
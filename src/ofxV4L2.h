@@ -40,6 +40,9 @@
  *
  **/
 
+#ifndef OFXV4L2_H
+#define OFXV4L2_H
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -54,6 +57,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 
@@ -61,13 +65,46 @@
 
 #include <linux/videodev2.h>
 
+#include <pthread.h>
+#include <sched.h>
+#include <atomic>
+
 #define CLEAR(x) memset (&(x), 0, sizeof (x))
 
+class ofxV4L2FrameServer;
+class ofxV4L2Recorder;
+struct ofxV4L2BayerFormat;
+
 // grabbing modes
 #define IO_METHOD_READ 		0
 #define IO_METHOD_MMAP 		1
 #define IO_METHOD_USERPTR 	2
 
+// recording codecs (see startRecording())
+#define RECORD_NONE 	0
+#define RECORD_LZ4 		1
+#define RECORD_ZSTD 	2
+#define RECORD_DEFAULT 	-1			// LZ4 if it is compiled in, else zstd, else none
+
+// formats of the frames returned by getPixels() (the value is the number of bytes per pixel)
+#define PIXELS_GRAY 	1
+#define PIXELS_RGB 		3
+
+// demosaic modes for Bayer capture formats (see setDemosaic())
+#define DEMOSAIC_BILINEAR 		0
+#define DEMOSAIC_EDGE 			1
+#define DEMOSAIC_HALF 			2
+
+// deinterlace modes (see setDeinterlace())
+#define DEINTERLACE_WEAVE 		0
+#define DEINTERLACE_BOB 		1
+#define DEINTERLACE_ADAPTIVE 	2
+
+// temporal denoise modes (see setDenoise())
+#define DENOISE_NONE 			0
+#define DENOISE_RECURSIVE 		1
+#define DENOISE_STACK 			2
+
 // setting defines (can be used as id value in call to 'settings()'
 // this list is just for ease of use inside an OF app
 #define ofxV4L2_BRIGHTNESS 			V4L2_CID_BRIGHTNESS
@@ -105,24 +142,178 @@ class ofxV4L2
 		// constructor (just used to initiate variable v4l2framerate to 0
 		ofxV4L2();
 
+        // the stages of capturing can be traced, see ofxV4L2Trace.h
         void grabFrame(void);
 		bool isNewFrame();
         unsigned char * getPixels(void);
 
+		// capture statistics, updated by grabFrame()
+		// handy to compare io methods and resolutions, e.g. against the vivid test driver
+		// in real-time mode they are a snapshot taken with the frame last picked up by grabFrame(), and
+		// resetStats() takes effect from the next frame the capture thread converts
+		struct stats
+		{
+			unsigned long frames;		// number of frames converted
+			unsigned long missed;		// number of calls to grabFrame() that found no frame
+			double process_last;		// time spent in process_image() for the last frame (ms)
+			double process_max;			// worst case time spent in process_image() (ms)
+			double process_total;		// total time spent in process_image() (ms)
+			double latency_last;		// time from the kernel timestamp until the frame was converted (ms)
+			double latency_max;			// worst case of latency_last (ms), only for mmap and userptr i/o
+		};
+		const stats & getStats(void);
+		void resetStats(void);
+
+		// metadata of a frame, filled in while capturing without allocations
+		static const unsigned int META_MAX = 1024;	// bytes of metadata node payload kept per frame
+		struct frameinfo
+		{
+			unsigned int sequence;		// v4l2 sequence number (a frame counter for read i/o)
+			struct timeval timestamp;	// kernel timestamp of the frame
+			unsigned int tsflags;		// V4L2_BUF_FLAG_TIMESTAMP_* and V4L2_BUF_FLAG_TSTAMP_SRC_* bits of the buffer
+			int exposure;				// ofxV4L2_EXPOSURE, ofxV4L2_GAIN and ofxV4L2_AUTOGAIN values in effect
+			int gain;					// when the frame was dequeued (-1 if the device does not have them)
+			int autogain;
+			double dequeued;			// monotonic time the frame was dequeued (ms)
+			double process_time;		// time spent in process_image() (ms)
+			bool changed;				// see isFrameChanged()
+			int field;					// v4l2 field of the frame: V4L2_FIELD_TOP/BOTTOM when built from one field
+			bool has_meta;				// a buffer of the metadata device was paired to this frame
+			unsigned int meta_length;	// bytes in meta
+			unsigned char meta[META_MAX];	// payload of the metadata buffer (e.g. UVC metadata blocks)
+		};
+		// metadata of the frame returned by getPixels()
+		const frameinfo & getFrameInfo(void);
+
+		// metadata node (V4L2_BUF_TYPE_META_CAPTURE) to capture along with the video, e.g. /dev/video1
+		// for a UVC camera on /dev/video0; its buffers are paired to frames by sequence number
+		// setMetadataDevice should be called before initGrabber
+		void setMetadataDevice(const char * devname);
+
 		// allows one to set properties of capture device
 		// for each setting, a seperate function call is needed
 		// list available options: see the list of defines, these are the appropriate id values
 		// example: cam1.settings(ofxV4L2_GAIN, 100);
 		// returns 0 if succesfull (xioctl return value)
+		// exposure, gain and autogain values are remembered and reported with every frame (see frameinfo)
 		// this is quite a rudimentary approach to settings; an all-encompassing gui would be better
 		bool settings(int id, int val);
 
 		// setDesiredFramerate should be called before initGrabber
 		bool setDesiredFramerate(int fr);
+
+		// real-time capture: the dequeue/convert path runs on a dedicated thread
+		// priority: SCHED_FIFO priority (1-99), 0 keeps the default scheduler
+		// cpu: the cpu to pin the thread to, -1 for no pinning
+		// capture buffers and frames are locked in memory (mlock) and pre-faulted at start_capturing()
+		// grabFrame() then only picks up the newest converted frame, without blocking
+		// the worst case latency is reported in getStats().latency_max
+		// setRealtime should be called before initGrabber
+		void setRealtime(int priority = 0, int cpu = -1);
+
+		// field handling for interlaced devices (the field order is the one negotiated in init_device())
+		// mode: DEINTERLACE_WEAVE (lines used as captured), DEINTERLACE_BOB (one field, missing lines
+		// interpolated) or DEINTERLACE_ADAPTIVE (weave where the picture is static, bob where it moves;
+		// threshold is the difference that counts as motion)
+		// fieldrate: emit a frame per field, so grabFrame() returns 2 frames per captured buffer
+		// (in real-time mode too: the second field is returned by the grabFrame() after the first)
+		// with V4L2_FIELD_ALTERNATE, V4L2_FIELD_TOP or V4L2_FIELD_BOTTOM every buffer holds one field and is always bobbed
+		// setDeinterlace should be called before initGrabber
+		void setDeinterlace(int mode, bool fieldrate = false, int threshold = 16);
+		int getField();						// negotiated v4l2 field order, e.g. V4L2_FIELD_NONE for progressive
+
+		// shares every frame with other processes through shared memory (see ofxV4L2FrameServer.h)
+		// clients use ofxV4L2FrameClient with the same name; raw publishes the buffers as captured
+		// instead of the converted frames; slots is the number of frames in the ring
+		// serveFrames should be called before initGrabber
+		void serveFrames(const char * name, bool raw = false, int slots = 8);
+
+		// records every frame to a file, compressed on a pool of worker threads (see ofxV4L2Recorder.h)
+		// raw: record the buffers as captured instead of the converted frames
+		// codec: RECORD_NONE, RECORD_LZ4, RECORD_ZSTD or RECORD_DEFAULT; delta: code frames as the difference with the previous one
+		// frames are dropped rather than delaying capture when the workers cannot keep up
+		// startRecording should be called after initGrabber; returns false if the recording cannot be started
+		bool startRecording(const char * filename, bool raw = true, int codec = RECORD_DEFAULT, bool delta = true, int threads = 2);
+		bool stopRecording(void);	// returns false if the recording could not be written completely
+		ofxV4L2Recorder & getRecorder(void);	// for the compression ratio and throughput
+
+		// output: frames are written to a v4l2 output device, e.g. a v4l2loopback virtual camera
+		// the buffer handling is the same as for capturing (init_mmap(), init_userp(), start_capturing())
+		// pixelformat is the format of the frames given to putFrame(); frames from getPixels() are V4L2_PIX_FMT_GREY
+		// (V4L2_PIX_FMT_RGB24 with PIXELS_RGB)
+		void initOutput(const char * devname, int iomethod, int cw, int ch, unsigned int pixelformat = V4L2_PIX_FMT_GREY);
+		// copies a frame into a free output buffer and queues it; waits at most timeout ms for a free buffer
+		// returns false if no buffer came free (the frame is dropped)
+		bool putFrame(const void * data, unsigned int length, int timeout = 2000);
+		// capture -> output chain: every captured frame is passed on to an output set up with initOutput(),
+		// without waiting for it; if the output uses the capture format, size and bytes per line, the captured
+		// buffer is passed on as it is, otherwise the converted frame (if the output uses the format of getPixels())
+		// setOutput should be called before initGrabber
+		void setOutput(ofxV4L2 * sink);
+
+		// temporal noise reduction for low light, applied to every line right after conversion
+		// DENOISE_RECURSIVE: running average, strength is the weight of a new frame in 1/256 (64: 25%)
+		// DENOISE_STACK: mean of the last 'frames' frames
+		// in both modes a pixel that differs more than threshold (0-255) from the average is
+		// considered moving and is taken from the new frame, which avoids motion trails
+		// setDenoise should be called before initGrabber
+		void setDenoise(int mode, int strength = 64, int threshold = 24, int frames = 4);
+
+		// format of the frames returned by getPixels(): PIXELS_GRAY (default) or PIXELS_RGB
+		// initGrabber picks the conversion kernel for the negotiated capture format, the width and this
+		// format, preferring one specialized for the width (see ofxV4L2Kernels.h)
+		// setPixelsFormat should be called before initGrabber
+		void setPixelsFormat(int format);
+		int getPixelsFormat();
+		// size of the frames returned by getPixels()
+		int getWidth();
+		int getHeight();
+
+		// pixel format requested from the device, V4L2_PIX_FMT_YUYV by default
+		// raw Bayer formats (V4L2_PIX_FMT_SGRBG8, V4L2_PIX_FMT_SRGGB10, ...) are demosaiced while converting
+		// setCaptureFormat should be called before initGrabber
+		void setCaptureFormat(unsigned int fourcc);
+		// demosaic mode for Bayer formats: DEMOSAIC_BILINEAR (default), DEMOSAIC_EDGE (green interpolated
+		// along edges, less zipper artifacts) or DEMOSAIC_HALF (one pixel per 2x2 block, frames of half
+		// the width and height); deinterlacing does not apply to Bayer formats
+		// setDemosaic should be called before initGrabber
+		void setDemosaic(int mode);
+		// white balance gains for Bayer formats, applied while unpacking the samples (1.0: unchanged)
+		// can be called at any time
+		void setWhiteBalance(float red, float green, float blue);
+
+		// lens undistortion, from the camera intrinsics (focal lengths fx, fy and principal point cx, cy,
+		// in pixels) and distortion coefficients (radial k1, k2, k3 and tangential p1, p2, as in OpenCV)
+		// initGrabber computes a fixed point lookup table once; frames are then remapped with bilinear
+		// interpolation straight from the captured buffer, a band of tiles at a time; points that fall
+		// outside the captured frame take the nearest edge pixel
+		// works for the GREY, YUYV and UYVY capture formats; deinterlacing does not apply
+		// setUndistort should be called before initGrabber
+		void setUndistort(float fx, float fy, float cx, float cy, float k1, float k2, float p1 = 0, float p2 = 0, float k3 = 0);
+
+		// change detection, computed while converting a frame in process_image()
+		// the frame is divided in tiles of tilesize x tilesize pixels; every other pixel of every
+		// other row is compared against the previous frame (sum of absolute differences)
+		// a tile counts as changed when the mean absolute difference exceeds threshold (0-255)
+		// setChangeDetection should be called before initGrabber
+		void setChangeDetection(bool enable, int tilesize = 32, int threshold = 8);
+		bool isFrameChanged();					// false if no tile changed: the frame can be skipped
+		const unsigned char * getChangedTiles();	// one entry per tile (row major), 1 if changed
+		int getTilesX();
+		int getTilesY();
         void initGrabber(const char * devname, int iomethod, int cw, int ch);
+
+		// synthetic source: instead of a device, frames of format 'pixelformat' handed to feedFrame()
+		// go through the same conversion and stages as captured ones (for benchmarks and tests)
+		// stride is the distance between lines in bytes, 0 for lines without padding; setRealtime does not apply
+		void initSynthetic(int cw, int ch, unsigned int pixelformat, unsigned int stride = 0);
+		// converts a frame as if it was just dequeued; getPixels() and getFrameInfo() then return it
+		void feedFrame(const void * data, unsigned int length);
+
         // three below are called inside initGrabber()
         void open_device(const char * devname);
         void init_device(void);
+        void init_output_device(unsigned int pixelformat);
 		void start_capturing(void);
 
 		// methods called inside the destructor
@@ -133,6 +324,7 @@ class ofxV4L2
 		// methods called inside other methods
         void errno_exit (const char * s);
         int xioctl(int fd, int request, void * arg);
+        bool read_frame(int timeout);
         void process_image(const void * p, int length);
         void init_userp (unsigned int buffer_size);
         void init_mmap (void);
@@ -150,14 +342,155 @@ class ofxV4L2
             size_t                  length;
         };
 
-        unsigned char * image;		// used to store captured frame for use in an app
+        static const int N_FRAMES = 6;
+        unsigned char * frames[N_FRAMES];	// used to store captured frames, see init_frames()
+        unsigned char * output;		// frame process_image() converts into
+        int front, back;			// index of the frame used by the app, and of the one being converted
+        int appfield;				// in real-time mode the app's second frame, see grab_frame()
+        bool apppending;			// frames[appfield] holds a second field the app has not seen yet
+        std::atomic<int> ready;		// newest converted pair of frames: first | second << 3, or'ed with FRAME_FRESH and FRAME_PAIR
+        static const int FRAME_FRESH = 64;
+        static const int FRAME_PAIR = 128;	// the second frame of the pair holds a field too
         int camWidth, camHeight;	// must be set before calling init_device()
-        char * dev_name;			// device name
+        const char * dev_name;		// device name
         int io;						// input method
         int fd;						// file descriptor (used to address the device)
+        enum v4l2_buf_type buftype;	// V4L2_BUF_TYPE_VIDEO_CAPTURE, or V4L2_BUF_TYPE_VIDEO_OUTPUT after initOutput()
+        unsigned int out_next;		// output buffers that were never queued start here
+        ofxV4L2 * sink;				// see setOutput()
+        void output_frame(const void * p, unsigned int length);
         struct buffer * buffers;	// pointer to buffers (no idea what this exactly means, neither how it is used)
-        int n_buffers;				// ??
+        unsigned int n_buffers;		// number of buffers in use
 		int v4l2framerate;			// desired framerate
         bool newframe;				// used to check if a new frame is there
+		stats framestats;			// see getStats(); in real-time mode only the capture thread touches it
+		stats appstats;				// in real-time mode: the snapshot that came with the app's frame
+		stats slotstats[N_FRAMES];	// snapshot of framestats handed over with frames[i] (real-time mode)
+		unsigned int slotreset[N_FRAMES];	// value of statsreset the snapshot in slotstats[i] belongs to
+		std::atomic<unsigned int> statsreset;	// incremented by resetStats(), carried out by the capture thread
+		unsigned int statsseen;		// last value of statsreset the capture thread carried out
+		void update_latency(const struct v4l2_buffer & buf);
+
+		// field handling (see setDeinterlace())
+		const unsigned char * frame_line(const unsigned char * p, int row);
+		const unsigned char * field_line(const unsigned char * p, int row, int parity, unsigned char * tmp);
+		int field;					// negotiated v4l2 field order
+		int firstfield;				// parity of the first field in time (0: top, 1: bottom), or of the only one
+		int curfield;				// parity of the field to use for the buffer being converted
+		int deinterlace, deinterlace_threshold;
+		bool fieldrate;
+		bool fieldpending;			// the second field of the last buffer is in frames[fieldslot]
+		int fieldslot;
+		unsigned char * linebuf;	// interpolated raw line
+
+		// frame server (see serveFrames())
+		void serve_frame(const void * p, unsigned int length);
+		ofxV4L2FrameServer * server;
+		const char * serve_name;
+		bool serve_raw;
+		int serve_slots;
+
+		// recording (see startRecording())
+		void record_frame(const void * p, unsigned int length);
+		ofxV4L2Recorder * recorder;
+		bool record_raw;
+
+		// temporal noise reduction (see setDenoise())
+		void init_denoise(void);
+		void denoise_line(unsigned char * line, int row, int later);
+		void next_denoise_frame(int frames);
+		int denoise, denoise_strength, denoise_threshold, denoise_frames;
+		unsigned short * denoise_acc;	// running average (8.8 fixed point) or running sum, per pixel
+		unsigned char * denoise_ring;	// last denoise_frames frames, for stacking
+		int denoise_next;				// frame in the ring to replace next
+		bool denoise_first;				// no state yet, start from the next frame
+
+		// per frame metadata (see getFrameInfo())
+		void cache_control(int id, int val);
+		void init_control_cache(void);
+		void begin_frame(const struct v4l2_buffer * buf);
+		frameinfo info[N_FRAMES];	// metadata belonging to frames[]
+		std::atomic<int> exposure, gain, autogain;	// cached control values, set by settings()
+
+		// metadata node (see setMetadataDevice())
+		static const unsigned int META_BUFFERS = 8;
+		void init_meta(void);
+		void uninit_meta(void);
+		void read_meta(frameinfo & fi);
+		const char * meta_name;
+		int meta_fd;
+		struct buffer meta_buffers[META_BUFFERS];
+		unsigned int n_meta;
+		struct v4l2_buffer meta_buf;	// metadata buffer held for a frame that has not arrived yet
+		bool meta_held;
+
+		// tracing (see ofxV4L2Trace.h)
+		void grab_frame(void);
+		unsigned long long consumer_trace;	// start of the application's work on the current frame
+
+		// real-time capture (see setRealtime())
+		static void * capture_thread(void * arg);
+		void capture_loop(void);
+		void start_thread(void);
+		void stop_thread(void);
+		void lock_memory(void * start, size_t length);
+		bool realtime;
+		int rtpriority, rtcpu;
+		pthread_t thread;
+		std::atomic<bool> running;
+		unsigned int bytesperline;	// stride of a captured line, as negotiated in init_device()
+		unsigned int imagesize;		// bytes in a captured buffer, as negotiated in init_device()
+		unsigned int pixelformat;	// pixel format, as negotiated in init_device()
+		unsigned int capture_format;	// pixel format requested in init_device(), see setCaptureFormat()
+		int pixels;					// format of the converted frames (bytes per pixel), see setPixelsFormat()
+		int width, height;			// size of the converted frames
+		int linesize, framesize;	// bytes in a line and in a converted frame
+		void (* kernel)(unsigned char * dst, const unsigned char * src, int width);	// see select_kernel()
+		void init_frames(int cw, int ch);
+		void init_processing(void);
+		void select_kernel(void);
+		unsigned int pixels_fourcc(void);
+
+		// Bayer formats (see setCaptureFormat())
+		void select_demosaic(void);
+		const unsigned char * bayer_line(const unsigned char * src, int k);
+		void demosaic_line(unsigned char * dst, const unsigned char * src, int row);
+		const ofxV4L2BayerFormat * bayer;	// NULL unless the negotiated format is a Bayer format
+		int demosaic;
+		std::atomic<int> wbgain[3];		// white balance, 8.8 fixed point
+		int bayergain[3];				// gains used for the current frame
+		void (* unpack)(unsigned char * dst, const unsigned char * src, int width, int g0, int g1);
+		void (* demosaic_kernels[4])(unsigned char * dst, const unsigned char * up, const unsigned char * cur,
+			const unsigned char * down, int width);
+		unsigned char * bayerlines;		// the last 3 unpacked lines, with padding
+		int bayertag[3];				// captured line held by each of them, -1 if none
+
+		// lens undistortion (see setUndistort())
+		void init_remap(void);
+		void remap_band(const unsigned char * src, int row);
+		static const int REMAP_TILE_W = 64, REMAP_TILE_H = 16;	// output pixels per tile
+		bool remap;
+		double intrinsics[4];			// fx, fy, cx, cy
+		double distortion[5];			// k1, k2, p1, p2, k3
+		unsigned int * mapoffset;		// per output pixel: offset of the top left source sample
+		unsigned int * mapfrac;			// per output pixel: weights of the right and lower samples, see ofxV4L2Kernels.h
+		void (* remap_kernel)(unsigned char * dst, const unsigned char * src, const unsigned int * offset,
+			const unsigned int * frac, int n, int stride);
+
+		// change detection (see setChangeDetection())
+		void init_change_detection(void);
+		void detect_changes(const unsigned char * line, int row);
+		void finish_change_detection(void);
+		bool changedetect;			// change detection enabled
+		bool framechanged;			// at least one tile changed in the last converted frame
+		bool changefirst;			// no reference frame yet
+		int tilesize, tilethreshold;
+		int tilesX, tilesY;
+		unsigned char * changeref;	// downsampled previous frame
+		unsigned int * tilesad;		// sum of absolute differences per tile
+		unsigned int * tilelimit;	// sad above which a tile counts as changed
+		unsigned char * changedtiles;	// one tile map per frame, see getChangedTiles()
 
 };
+
+#endif // OFXV4L2_H
@@ -0,0 +1,295 @@
+/**
+ *
+ * ofxV4L2FrameServer - shares frames of one ofxV4L2 grabber with other processes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **/
+
+#include "ofxV4L2FrameServer.h"
+
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define RING_MAGIC 		0x4c345676
+#define RING_VERSION 	1
+#define RING_HEADER 	4096		// slots start at a page boundary
+
+// layout of the shared memory object: a header followed by 'slots' slots of 'slotsize' bytes
+struct ofxV4L2Ring
+{
+	unsigned int magic;
+	unsigned int version;
+	unsigned int slots;
+	unsigned int slotsize;
+	unsigned int length;						// capacity of a slot in bytes
+	pid_t server;
+	std::atomic<unsigned long long> published;	// number of the newest complete frame (the first one is 1)
+	std::atomic<int> futex;						// changes with every frame, clients wait on it
+};
+
+struct ofxV4L2Slot
+{
+	std::atomic<unsigned long long> seq;		// 2n - 1 while frame n is written, 2n once it is complete
+	ofxV4L2SharedFrame frame;
+};
+
+// frame data follows the slot header, cache line aligned
+#define SLOT_DATA 		((sizeof (ofxV4L2Slot) + 63) & ~63)
+
+static inline ofxV4L2Slot * ring_slot(const ofxV4L2Ring * r, unsigned long long n)
+{
+	return (ofxV4L2Slot *) ((char *) r + RING_HEADER + ((n - 1) % r->slots) * r->slotsize);
+}
+
+static inline long futex(std::atomic<int> * addr, int op, int val, const struct timespec * timeout)
+{
+	return syscall (SYS_futex, (int *) addr, op, val, timeout, NULL, 0);
+}
+
+ofxV4L2FrameServer::ofxV4L2FrameServer()
+{
+	shared = NULL;
+	size = 0;
+	name[0] = 0;
+}
+
+bool ofxV4L2FrameServer::setup(const char * shmname, unsigned int width, unsigned int height, unsigned int length,
+	unsigned int pixelformat, unsigned int slots)
+{
+	unsigned int slotsize, page_size = getpagesize ();
+	unsigned int i;
+	int shmfd;
+
+	snprintf (name, sizeof (name), "/%s", shmname);
+	slotsize = (SLOT_DATA + length + page_size - 1) & ~(page_size - 1);
+	size = RING_HEADER + (size_t) slots * slotsize;
+
+	shmfd = shm_open (name, O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (-1 == shmfd)
+	{
+		fprintf (stderr, "Cannot create shared memory '%s': %d, %s\n", name, errno, strerror (errno));
+		return false;
+	}
+
+	if (-1 == ftruncate (shmfd, size))
+	{
+		fprintf (stderr, "Cannot size shared memory '%s': %d, %s\n", name, errno, strerror (errno));
+		close (shmfd);
+		return false;
+	}
+
+	shared = (ofxV4L2Ring *) mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0);
+	close (shmfd);
+	if (MAP_FAILED == shared)
+	{
+		fprintf (stderr, "Cannot map shared memory '%s': %d, %s\n", name, errno, strerror (errno));
+		shared = NULL;
+		return false;
+	}
+
+	// the object is freshly truncated, so all counters start at zero
+	shared->slots = slots;
+	shared->slotsize = slotsize;
+	shared->length = length;
+	shared->server = getpid ();
+	for (i = 1; i <= slots; i++)
+	{
+		ofxV4L2SharedFrame & f = ring_slot(shared, i)->frame;
+		f.width = width;
+		f.height = height;
+		f.pixelformat = pixelformat;
+	}
+	shared->version = RING_VERSION;
+	std::atomic_thread_fence (std::memory_order_release);
+	shared->magic = RING_MAGIC;
+
+	fprintf (stdout, "Serving frames on shared memory '%s' (%u slots)\n", name, slots);
+	return true;
+}
+
+void ofxV4L2FrameServer::publish(const void * data, unsigned int length, const ofxV4L2::frameinfo & info)
+{
+	unsigned long long n;
+	ofxV4L2Slot * s;
+
+	if (!shared)
+		return;
+
+	n = shared->published.load(std::memory_order_relaxed) + 1;
+	s = ring_slot(shared, n);
+
+	// mark the slot as being written before touching its contents
+	s->seq.store(2 * n - 1, std::memory_order_relaxed);
+	std::atomic_thread_fence (std::memory_order_release);
+
+	if (length > shared->length)
+		length = shared->length;
+	s->frame.length = length;
+	s->frame.sequence = info.sequence;
+	s->frame.tv_sec = info.timestamp.tv_sec;
+	s->frame.tv_usec = info.timestamp.tv_usec;
+	s->frame.exposure = info.exposure;
+	s->frame.gain = info.gain;
+	s->frame.field = info.field;
+	memcpy ((char *) s + SLOT_DATA, data, length);
+
+	s->seq.store(2 * n, std::memory_order_release);
+	shared->published.store(n, std::memory_order_release);
+	shared->futex.fetch_add(1, std::memory_order_release);
+	futex (&shared->futex, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+ofxV4L2FrameServer::~ofxV4L2FrameServer()
+{
+	if (!shared)
+		return;
+
+	munmap (shared, size);
+	shm_unlink (name);
+}
+
+ofxV4L2FrameClient::ofxV4L2FrameClient()
+{
+	shared = NULL;
+	size = 0;
+	last = 0;
+	dropped = 0;
+	current = NULL;
+	currentseq = 0;
+}
+
+bool ofxV4L2FrameClient::setup(const char * shmname)
+{
+	char name[64];
+	struct stat st;
+	int shmfd;
+
+	snprintf (name, sizeof (name), "/%s", shmname);
+	shmfd = shm_open (name, O_RDONLY, 0);
+	if (-1 == shmfd)
+	{
+		fprintf (stderr, "Cannot open shared memory '%s': %d, %s\n", name, errno, strerror (errno));
+		return false;
+	}
+
+	if (-1 == fstat (shmfd, &st) || st.st_size < RING_HEADER)
+	{
+		fprintf (stderr, "'%s' is no frame server\n", name);
+		close (shmfd);
+		return false;
+	}
+
+	size = st.st_size;
+	shared = (const ofxV4L2Ring *) mmap (NULL, size, PROT_READ, MAP_SHARED, shmfd, 0);
+	close (shmfd);
+	if (MAP_FAILED == shared)
+	{
+		fprintf (stderr, "Cannot map shared memory '%s': %d, %s\n", name, errno, strerror (errno));
+		shared = NULL;
+		return false;
+	}
+
+	if (RING_MAGIC != shared->magic || RING_VERSION != shared->version
+		|| RING_HEADER + (size_t) shared->slots * shared->slotsize > size)
+	{
+		fprintf (stderr, "'%s' is no frame server (or a different version)\n", name);
+		munmap ((void *) shared, size);
+		shared = NULL;
+		return false;
+	}
+
+	// start with the newest frame
+	last = shared->published.load(std::memory_order_acquire);
+	if (last > 0)
+		last--;
+	return true;
+}
+
+const unsigned char * ofxV4L2FrameClient::waitFrame(int timeout, ofxV4L2SharedFrame * frame)
+{
+	struct timespec now, end, left;
+	unsigned long long n, seq;
+	const ofxV4L2Slot * s;
+	int f;
+
+	if (!shared)
+		return NULL;
+
+	clock_gettime (CLOCK_MONOTONIC, &end);
+	end.tv_sec += timeout / 1000;
+	end.tv_nsec += (timeout % 1000) * 1000000L;
+	if (end.tv_nsec >= 1000000000L)
+	{
+		end.tv_sec++;
+		end.tv_nsec -= 1000000000L;
+	}
+
+	for (;;)
+	{
+		f = shared->futex.load(std::memory_order_acquire);
+		n = shared->published.load(std::memory_order_acquire);
+		if (n > last)
+		{
+			s = ring_slot(shared, n);
+			seq = s->seq.load(std::memory_order_acquire);
+			// if the slot is already being reused the server lapped us: try again with the newest frame
+			if (seq != 2 * n)
+				continue;
+
+			if (frame)
+				*frame = s->frame;
+			dropped += n - last - 1;
+			last = n;
+			current = s;
+			currentseq = seq;
+			return (const unsigned char *) s + SLOT_DATA;
+		}
+
+		clock_gettime (CLOCK_MONOTONIC, &now);
+		left.tv_sec = end.tv_sec - now.tv_sec;
+		left.tv_nsec = end.tv_nsec - now.tv_nsec;
+		if (left.tv_nsec < 0)
+		{
+			left.tv_sec--;
+			left.tv_nsec += 1000000000L;
+		}
+		if (left.tv_sec < 0)
+			return NULL;
+
+		// sleeps only if no frame was published since 'f' was read
+		futex ((std::atomic<int> *) &shared->futex, FUTEX_WAIT, f, &left);
+	}
+}
+
+bool ofxV4L2FrameClient::isValid()
+{
+	if (!current)
+		return false;
+
+	std::atomic_thread_fence (std::memory_order_acquire);
+	return current->seq.load(std::memory_order_relaxed) == currentseq;
+}
+
+unsigned long long ofxV4L2FrameClient::getDropped()
+{
+	return dropped;
+}
+
+ofxV4L2FrameClient::~ofxV4L2FrameClient()
+{
+	if (shared)
+		munmap ((void *) shared, size);
+}
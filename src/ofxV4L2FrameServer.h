@@ -0,0 +1,106 @@
+/**
+ *
+ * ofxV4L2FrameServer - shares frames of one ofxV4L2 grabber with other processes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESCRIPTION
+ *
+ * V4L2 allows only one process to stream from a device. The server side copies every
+ * frame into a ring of slots in a shared memory object (/dev/shm/<name>), the client
+ * side maps that object read-only and reads frames in place.
+ *
+ * The server never waits for clients: a slot is simply overwritten once the ring wraps.
+ * Every slot carries a sequence counter that is odd while the slot is being written, so
+ * a client can tell whether the frame it used was overwritten in the meantime (a seqlock).
+ * Clients hold no state in the ring, so slow or crashed clients cannot affect the server
+ * or each other. New frames are signalled with a futex in the ring header.
+ *
+ **/
+
+#ifndef OFXV4L2_FRAMESERVER_H
+#define OFXV4L2_FRAMESERVER_H
+
+#include "ofxV4L2.h"
+
+// description of a frame in the ring
+struct ofxV4L2SharedFrame
+{
+	unsigned int length;		// bytes of frame data
+	unsigned int width, height;
+	unsigned int pixelformat;	// V4L2_PIX_FMT_GREY or RGB24 for converted frames, the device format for raw frames
+	unsigned int sequence;		// see ofxV4L2::frameinfo
+	long long tv_sec, tv_usec;
+	int exposure, gain;
+	int field;
+};
+
+class ofxV4L2FrameServer
+{
+	public:
+
+		ofxV4L2FrameServer();
+
+		// creates the shared memory object /dev/shm/<name> with room for 'slots' frames of at most 'length' bytes
+		// returns false if it cannot be created
+		bool setup(const char * name, unsigned int width, unsigned int height, unsigned int length,
+			unsigned int pixelformat, unsigned int slots = 8);
+
+		// copies a frame into the next slot and wakes up waiting clients
+		void publish(const void * data, unsigned int length, const ofxV4L2::frameinfo & info);
+
+		// removes the shared memory object
+		~ofxV4L2FrameServer();
+
+	private:
+
+		struct ofxV4L2Ring * shared;
+		size_t size;
+		char name[64];
+};
+
+class ofxV4L2FrameClient
+{
+	public:
+
+		ofxV4L2FrameClient();
+
+		// maps the ring of a server read-only, returns false if there is no server with this name
+		bool setup(const char * name);
+
+		// waits at most timeout ms for a frame newer than the previous one
+		// returns a pointer into shared memory (no copy), or NULL on a timeout
+		// frame (if not NULL) receives the description of the frame
+		const unsigned char * waitFrame(int timeout, ofxV4L2SharedFrame * frame = NULL);
+
+		// true if the frame returned by waitFrame() was not overwritten while it was used
+		// call when done with the frame; if false, the data read may be torn and should be dropped
+		bool isValid();
+
+		// number of frames the server published that this client never saw
+		unsigned long long getDropped();
+
+		~ofxV4L2FrameClient();
+
+	private:
+
+		const struct ofxV4L2Ring * shared;
+		size_t size;
+		unsigned long long last;		// number of the last frame returned
+		unsigned long long dropped;
+		const struct ofxV4L2Slot * current;	// slot of the frame returned by waitFrame()
+		unsigned long long currentseq;			// its sequence counter when it was returned
+};
+
+#endif // OFXV4L2_FRAMESERVER_H
@@ -0,0 +1,171 @@
+/**
+ *
+ * ofxV4L2Kernels - line conversion kernels used by ofxV4L2::process_image()
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **/
+
+#include "ofxV4L2.h"
+#include "ofxV4L2Kernels.h"
+
+struct ofxV4L2KernelEntry
+{
+	unsigned int pixelformat;	// capture format
+	int pixels;					// PIXELS_GRAY or PIXELS_RGB
+	int width;					// 0 for the generic kernel
+	ofxV4L2LineKernel kernel;
+};
+
+#define PACKED422(fmt) \
+	{ fmt, PIXELS_GRAY, 0, ofxV4L2Packed422ToGray<fmt, 0> }, \
+	{ fmt, PIXELS_RGB, 0, ofxV4L2Packed422ToRgb<fmt, 0> }
+
+#define PACKED422_RGB(fmt, w) \
+	{ fmt, PIXELS_RGB, w, ofxV4L2Packed422ToRgb<fmt, w> }
+
+// specialized kernels first, the generic ones (width 0) last
+// only the RGB kernels are specialized: a fixed width saves 15-25% there (no partial chunk, see the
+// kernel runs of ofxv4l2-bench), the gray ones are bound by memory bandwidth and gain nothing
+static const ofxV4L2KernelEntry kernels[] =
+{
+	PACKED422_RGB(V4L2_PIX_FMT_YUYV, 640),
+	PACKED422_RGB(V4L2_PIX_FMT_YUYV, 1280),
+	PACKED422_RGB(V4L2_PIX_FMT_YUYV, 1920),
+	PACKED422_RGB(V4L2_PIX_FMT_UYVY, 640),
+	PACKED422_RGB(V4L2_PIX_FMT_UYVY, 1280),
+	PACKED422_RGB(V4L2_PIX_FMT_UYVY, 1920),
+
+	PACKED422(V4L2_PIX_FMT_YUYV),
+	PACKED422(V4L2_PIX_FMT_UYVY),
+	{ V4L2_PIX_FMT_GREY, PIXELS_GRAY, 0, ofxV4L2GrayToGray<0> },
+	{ V4L2_PIX_FMT_GREY, PIXELS_RGB, 0, ofxV4L2GrayToRgb<0> },
+};
+
+ofxV4L2LineKernel ofxV4L2FindKernel(unsigned int pixelformat, int pixels, int width, bool * specialized)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof (kernels) / sizeof (kernels[0]); i++)
+	{
+		const ofxV4L2KernelEntry & k = kernels[i];
+		if (k.pixelformat == pixelformat && k.pixels == pixels && (k.width == width || 0 == k.width))
+		{
+			if (specialized)
+				*specialized = 0 != k.width;
+			return k.kernel;
+		}
+	}
+	return NULL;
+}
+
+static const ofxV4L2BayerFormat bayerformats[] =
+{
+	{ V4L2_PIX_FMT_SBGGR8, 1, 1, 8, false },
+	{ V4L2_PIX_FMT_SGBRG8, 0, 1, 8, false },
+	{ V4L2_PIX_FMT_SGRBG8, 1, 0, 8, false },
+	{ V4L2_PIX_FMT_SRGGB8, 0, 0, 8, false },
+	{ V4L2_PIX_FMT_SBGGR10, 1, 1, 10, false },
+	{ V4L2_PIX_FMT_SGBRG10, 0, 1, 10, false },
+	{ V4L2_PIX_FMT_SGRBG10, 1, 0, 10, false },
+	{ V4L2_PIX_FMT_SRGGB10, 0, 0, 10, false },
+	{ V4L2_PIX_FMT_SBGGR10P, 1, 1, 10, true },
+	{ V4L2_PIX_FMT_SGBRG10P, 0, 1, 10, true },
+	{ V4L2_PIX_FMT_SGRBG10P, 1, 0, 10, true },
+	{ V4L2_PIX_FMT_SRGGB10P, 0, 0, 10, true },
+	{ V4L2_PIX_FMT_SBGGR12, 1, 1, 12, false },
+	{ V4L2_PIX_FMT_SGBRG12, 0, 1, 12, false },
+	{ V4L2_PIX_FMT_SGRBG12, 1, 0, 12, false },
+	{ V4L2_PIX_FMT_SRGGB12, 0, 0, 12, false },
+	{ V4L2_PIX_FMT_SBGGR12P, 1, 1, 12, true },
+	{ V4L2_PIX_FMT_SGBRG12P, 0, 1, 12, true },
+	{ V4L2_PIX_FMT_SGRBG12P, 1, 0, 12, true },
+	{ V4L2_PIX_FMT_SRGGB12P, 0, 0, 12, true },
+	{ V4L2_PIX_FMT_SBGGR16, 1, 1, 16, false },
+	{ V4L2_PIX_FMT_SGBRG16, 0, 1, 16, false },
+	{ V4L2_PIX_FMT_SGRBG16, 1, 0, 16, false },
+	{ V4L2_PIX_FMT_SRGGB16, 0, 0, 16, false },
+};
+
+const ofxV4L2BayerFormat * ofxV4L2FindBayer(unsigned int pixelformat)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof (bayerformats) / sizeof (bayerformats[0]); i++)
+		if (bayerformats[i].pixelformat == pixelformat)
+			return &bayerformats[i];
+	return NULL;
+}
+
+ofxV4L2BayerUnpack ofxV4L2FindUnpack(const ofxV4L2BayerFormat * b)
+{
+	switch (b->bits)
+	{
+		case 8:
+			return ofxV4L2UnpackBayer<8>;
+		case 10:
+			return b->packed ? ofxV4L2UnpackBayerPacked<10> : ofxV4L2UnpackBayer<10>;
+		case 12:
+			return b->packed ? ofxV4L2UnpackBayerPacked<12> : ofxV4L2UnpackBayer<12>;
+		default:
+			return ofxV4L2UnpackBayer<16>;
+	}
+}
+
+#define DEMOSAIC(px, edge) \
+	k[0] = ofxV4L2Demosaic<px, edge, 0, 0>; \
+	k[1] = ofxV4L2Demosaic<px, edge, 0, 1>; \
+	k[2] = ofxV4L2Demosaic<px, edge, 1, 0>; \
+	k[3] = ofxV4L2Demosaic<px, edge, 1, 1>
+
+bool ofxV4L2FindDemosaic(int mode, int pixels, ofxV4L2DemosaicKernel * k)
+{
+	bool rgb = PIXELS_RGB == pixels;
+
+	switch (mode)
+	{
+		case DEMOSAIC_BILINEAR:
+			if (rgb) { DEMOSAIC(PIXELS_RGB, 0); } else { DEMOSAIC(PIXELS_GRAY, 0); }
+			return true;
+		case DEMOSAIC_EDGE:
+			if (rgb) { DEMOSAIC(PIXELS_RGB, 1); } else { DEMOSAIC(PIXELS_GRAY, 1); }
+			return true;
+		case DEMOSAIC_HALF:
+			k[0] = rgb ? ofxV4L2DemosaicHalf<PIXELS_RGB, 0> : ofxV4L2DemosaicHalf<PIXELS_GRAY, 0>;
+			k[1] = rgb ? ofxV4L2DemosaicHalf<PIXELS_RGB, 1> : ofxV4L2DemosaicHalf<PIXELS_GRAY, 1>;
+			return true;
+		default:
+			return false;
+	}
+}
+
+#define REMAP(fmt, step, y, u, v) \
+	{ fmt, step, y, u, v, ofxV4L2Remap<PIXELS_GRAY, step, u, v>, ofxV4L2Remap<PIXELS_RGB, step, u, v> }
+
+static const ofxV4L2RemapFormat remapformats[] =
+{
+	REMAP(V4L2_PIX_FMT_YUYV, 2, 0, 1, 3),
+	REMAP(V4L2_PIX_FMT_UYVY, 2, 1, 0, 2),
+	REMAP(V4L2_PIX_FMT_GREY, 1, 0, -1, -1),
+};
+
+const ofxV4L2RemapFormat * ofxV4L2FindRemap(unsigned int pixelformat)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof (remapformats) / sizeof (remapformats[0]); i++)
+		if (remapformats[i].pixelformat == pixelformat)
+			return &remapformats[i];
+	return NULL;
+}
@@ -0,0 +1,356 @@
+/**
+ *
+ * ofxV4L2Kernels - line conversion kernels used by ofxV4L2::process_image()
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESCRIPTION
+ *
+ * A kernel converts one captured line into one line of the frame returned by getPixels().
+ * Kernels are templates on the capture format, the output format and the line width.
+ * A width of 0 gives the generic kernel that takes the width at runtime; a fixed width
+ * lets the compiler unroll and vectorize the loop for that width exactly. The registry in
+ * ofxV4L2Kernels.cpp lists which combinations are instantiated; add a line there for the
+ * resolutions a deployment uses.
+ *
+ * Bayer formats go through two steps instead: every captured line is unpacked to 8 bits
+ * once (with the white balance applied), then a demosaic kernel builds an output line
+ * from the unpacked lines around it.
+ *
+ * Lens undistortion replaces the conversion kernel by a remap kernel, which reads the
+ * samples around the source position of every output pixel straight from the buffer.
+ *
+ **/
+
+#ifndef OFXV4L2_KERNELS_H
+#define OFXV4L2_KERNELS_H
+
+#include <stddef.h>
+#include <linux/videodev2.h>
+
+typedef void (* ofxV4L2LineKernel)(unsigned char * dst, const unsigned char * src, int width);
+
+// returns the best kernel for the combination: a specialized one if it is registered for
+// this width, otherwise the generic one; NULL if the capture format cannot be converted
+// specialized is set to true if a width specific kernel was found
+ofxV4L2LineKernel ofxV4L2FindKernel(unsigned int pixelformat, int pixels, int width, bool * specialized = NULL);
+
+static inline unsigned char ofxV4L2Clamp(int v)
+{
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+// BT.601 (limited range) YUV to RGB in fixed point
+static inline void ofxV4L2YuvToRgb(unsigned char * rgb, int y, int u, int v)
+{
+	int c = 298 * (y - 16) + 128;
+	int d = u - 128;
+	int e = v - 128;
+	rgb[0] = ofxV4L2Clamp((c + 409 * e) >> 8);
+	rgb[1] = ofxV4L2Clamp((c - 100 * d - 208 * e) >> 8);
+	rgb[2] = ofxV4L2Clamp((c + 516 * d) >> 8);
+}
+
+// position of the samples in a 4 byte macropixel of the packed 4:2:2 formats
+template <unsigned int FMT> struct ofxV4L2Packed422;
+template <> struct ofxV4L2Packed422<V4L2_PIX_FMT_YUYV> { enum { Y0 = 0, U = 1, Y1 = 2, V = 3 }; };
+template <> struct ofxV4L2Packed422<V4L2_PIX_FMT_UYVY> { enum { U = 0, Y0 = 1, V = 2, Y1 = 3 }; };
+
+template <unsigned int FMT, int W>
+void ofxV4L2Packed422ToGray(unsigned char * __restrict dst, const unsigned char * __restrict src, int width)
+{
+	const int w = W ? W : width;
+	for (int i = 0; i < w; i++)
+		dst[i] = src[2 * i + ofxV4L2Packed422<FMT>::Y0];
+}
+
+#define OFXV4L2_CHUNK 	256		// pixels converted per pass of the multi-pass kernels
+
+// in chunks of separate passes: Y, U and V are deinterleaved (chroma repeated for both pixels of
+// a macropixel), converted into planar R, G and B, then interleaved into the line; each pass is a
+// loop the compiler vectorizes (the interleaving one with SSSE3 or NEON, see OFXV4L2_MARCH),
+// a loop over macropixels reading and writing interleaved samples is not
+template <unsigned int FMT, int W>
+void ofxV4L2Packed422ToRgb(unsigned char * __restrict dst, const unsigned char * __restrict src, int width)
+{
+	typedef ofxV4L2Packed422<FMT> P;
+	const int w = (W ? W : width) & ~1;
+	unsigned char y[OFXV4L2_CHUNK], u[OFXV4L2_CHUNK], v[OFXV4L2_CHUNK];
+	unsigned char r[OFXV4L2_CHUNK], g[OFXV4L2_CHUNK], b[OFXV4L2_CHUNK];
+
+	for (int x = 0; x < w; x += OFXV4L2_CHUNK)
+	{
+		const int n = w - x < OFXV4L2_CHUNK ? w - x : OFXV4L2_CHUNK;
+		const unsigned char * s = src + 2 * x;
+		unsigned char * d = dst + 3 * x;
+
+		for (int i = 0; i < n; i++)
+			y[i] = s[2 * i + P::Y0];
+		for (int i = 0; i < n / 2; i++)
+		{
+			u[2 * i] = u[2 * i + 1] = s[4 * i + P::U];
+			v[2 * i] = v[2 * i + 1] = s[4 * i + P::V];
+		}
+		for (int i = 0; i < n; i++)
+		{
+			// ofxV4L2YuvToRgb, with planar stores
+			int c = 298 * (y[i] - 16) + 128;
+			int e = v[i] - 128;
+			int f = u[i] - 128;
+			r[i] = ofxV4L2Clamp((c + 409 * e) >> 8);
+			g[i] = ofxV4L2Clamp((c - 100 * f - 208 * e) >> 8);
+			b[i] = ofxV4L2Clamp((c + 516 * f) >> 8);
+		}
+		for (int i = 0; i < n; i++)
+		{
+			d[3 * i] = r[i];
+			d[3 * i + 1] = g[i];
+			d[3 * i + 2] = b[i];
+		}
+	}
+}
+
+template <int W>
+void ofxV4L2GrayToGray(unsigned char * __restrict dst, const unsigned char * __restrict src, int width)
+{
+	const int w = W ? W : width;
+	for (int i = 0; i < w; i++)
+		dst[i] = src[i];
+}
+
+template <int W>
+void ofxV4L2GrayToRgb(unsigned char * __restrict dst, const unsigned char * __restrict src, int width)
+{
+	const int w = W ? W : width;
+	for (int i = 0; i < w; i++)
+		dst[3 * i] = dst[3 * i + 1] = dst[3 * i + 2] = src[i];
+}
+
+// Bayer formats: the position of the red sample in the 2x2 pattern and the bits per sample
+// samples of more than 8 bits are stored in 16 bits, little endian, or for the MIPI CSI-2 packed
+// formats (SRGGB10P, SRGGB12P, ...) in groups of 4 (10 bit) or 2 (12 bit) samples: a byte with the
+// high 8 bits of every sample, then one byte with the low bits, of the first sample in the lowest bits
+struct ofxV4L2BayerFormat
+{
+	unsigned int pixelformat;
+	int redx, redy;
+	int bits;
+	bool packed;
+};
+
+// returns NULL if pixelformat is no Bayer format
+const ofxV4L2BayerFormat * ofxV4L2FindBayer(unsigned int pixelformat);
+
+// bytes of a line of width samples without padding
+static inline unsigned int ofxV4L2BayerLineBytes(const ofxV4L2BayerFormat * b, int width)
+{
+	return b->packed ? width * b->bits / 8 : width * (8 == b->bits ? 1 : 2);
+}
+
+// unpacks a Bayer line to 8 bits and applies the white balance gains (8.8 fixed point) of the
+// two colours on the line: g0 for the even columns, g1 for the odd ones
+typedef void (* ofxV4L2BayerUnpack)(unsigned char * dst, const unsigned char * src, int width, int g0, int g1);
+
+// returns the unpack kernel for a Bayer format
+ofxV4L2BayerUnpack ofxV4L2FindUnpack(const ofxV4L2BayerFormat * b);
+
+template <int BITS>
+void ofxV4L2UnpackBayer(unsigned char * __restrict dst, const unsigned char * __restrict src, int width, int g0, int g1)
+{
+	const unsigned short * s = (const unsigned short *) src;
+	for (int i = 0; i < width; i += 2)
+	{
+		int a = 8 == BITS ? src[i] : s[i];
+		int b = 8 == BITS ? src[i + 1] : s[i + 1];
+		dst[i] = ofxV4L2Clamp((a * g0) >> BITS);
+		dst[i + 1] = ofxV4L2Clamp((b * g1) >> BITS);
+	}
+}
+
+// MIPI CSI-2 packed samples; width must be a multiple of the group size
+template <int BITS>
+void ofxV4L2UnpackBayerPacked(unsigned char * __restrict dst, const unsigned char * __restrict src, int width, int g0, int g1)
+{
+	if (10 == BITS)
+	{
+		for (int i = 0; i < width / 4; i++)
+		{
+			const unsigned char * s = src + 5 * i;
+			dst[4 * i] = ofxV4L2Clamp((((s[0] << 2) | (s[4] & 3)) * g0) >> 10);
+			dst[4 * i + 1] = ofxV4L2Clamp((((s[1] << 2) | ((s[4] >> 2) & 3)) * g1) >> 10);
+			dst[4 * i + 2] = ofxV4L2Clamp((((s[2] << 2) | ((s[4] >> 4) & 3)) * g0) >> 10);
+			dst[4 * i + 3] = ofxV4L2Clamp((((s[3] << 2) | (s[4] >> 6)) * g1) >> 10);
+		}
+	}
+	else
+	{
+		for (int i = 0; i < width / 2; i++)
+		{
+			const unsigned char * s = src + 3 * i;
+			dst[2 * i] = ofxV4L2Clamp((((s[0] << 4) | (s[2] & 15)) * g0) >> 12);
+			dst[2 * i + 1] = ofxV4L2Clamp((((s[1] << 4) | (s[2] >> 4)) * g1) >> 12);
+		}
+	}
+}
+
+// a demosaic kernel converts unpacked lines (with one mirrored sample of padding on both sides)
+// into one output line: up, cur and down are the lines above, at and below the output line
+// for the half resolution kernels, up is the line with red samples, cur the one with blue samples
+// and down is not used; width is the width of the output line
+typedef void (* ofxV4L2DemosaicKernel)(unsigned char * dst, const unsigned char * up, const unsigned char * cur,
+	const unsigned char * down, int width);
+
+// fills k[2 * redrow + greenfirst] with the kernels for the four kinds of line in a Bayer pattern
+// (for DEMOSAIC_HALF: k[redx]), returns false if the mode is unknown
+bool ofxV4L2FindDemosaic(int mode, int pixels, ofxV4L2DemosaicKernel * k);
+
+// writes an interpolated pixel; c is the colour sampled on this line, o the other one
+template <int PX, int REDROW>
+static inline void ofxV4L2StoreBayer(unsigned char * dst, int c, int g, int o)
+{
+	int r = REDROW ? c : o, b = REDROW ? o : c;
+	if (3 == PX)
+	{
+		dst[0] = r;
+		dst[1] = g;
+		dst[2] = b;
+	}
+	else
+		dst[0] = (77 * r + 150 * g + 29 * b + 128) >> 8;
+}
+
+// green at a red or blue sample, interpolated along the direction with the smallest gradient
+static inline int ofxV4L2EdgeGreen(int l, int r, int u, int d)
+{
+	int h = l > r ? l - r : r - l;
+	int v = u > d ? u - d : d - u;
+	return h < v ? (l + r + 1) >> 1 : (v < h ? (u + d + 1) >> 1 : (l + r + u + d + 2) >> 2);
+}
+
+// bilinear (EDGE 0) or edge-aware (EDGE 1) demosaic of one line; REDROW: the line holds red samples,
+// GREENFIRST: the first sample of the line is green
+// RGB lines are built in chunks, like in ofxV4L2Packed422ToRgb: the colour sampled on the line, green
+// and the other colour are interpolated into planes first, then interleaved (a loop storing both
+// pixels of a pair as RGB directly does not vectorize); gray lines are stored directly
+template <int PX, int EDGE, int REDROW, int GREENFIRST>
+void ofxV4L2Demosaic(unsigned char * __restrict dst, const unsigned char * __restrict up, const unsigned char * __restrict cur,
+	const unsigned char * __restrict down, int width)
+{
+	if (1 == PX)
+	{
+		for (int x = 0; x < width; x += 2)
+		{
+			const int c = GREENFIRST ? x + 1 : x;
+			const int g = GREENFIRST ? x : x + 1;
+
+			int gc = EDGE ? ofxV4L2EdgeGreen(cur[c - 1], cur[c + 1], up[c], down[c])
+				: (cur[c - 1] + cur[c + 1] + up[c] + down[c] + 2) >> 2;
+			ofxV4L2StoreBayer<PX, REDROW>(dst + c, cur[c], gc, (up[c - 1] + up[c + 1] + down[c - 1] + down[c + 1] + 2) >> 2);
+			ofxV4L2StoreBayer<PX, REDROW>(dst + g, (cur[g - 1] + cur[g + 1] + 1) >> 1, cur[g], (up[g] + down[g] + 1) >> 1);
+		}
+		return;
+	}
+
+	unsigned char own[OFXV4L2_CHUNK], green[OFXV4L2_CHUNK], other[OFXV4L2_CHUNK];
+	for (int x0 = 0; x0 < width; x0 += OFXV4L2_CHUNK)
+	{
+		const int n = width - x0 < OFXV4L2_CHUNK ? width - x0 : OFXV4L2_CHUNK;
+		const unsigned char * u = up + x0, * s = cur + x0, * d = down + x0;
+		const unsigned char * r = REDROW ? own : other, * b = REDROW ? other : own;
+		unsigned char * o = dst + 3 * x0;
+
+		for (int x = 0; x < n; x += 2)
+		{
+			const int c = GREENFIRST ? x + 1 : x;
+			const int g = GREENFIRST ? x : x + 1;
+
+			own[c] = s[c];
+			green[c] = EDGE ? ofxV4L2EdgeGreen(s[c - 1], s[c + 1], u[c], d[c]) : (s[c - 1] + s[c + 1] + u[c] + d[c] + 2) >> 2;
+			other[c] = (u[c - 1] + u[c + 1] + d[c - 1] + d[c + 1] + 2) >> 2;
+			own[g] = (s[g - 1] + s[g + 1] + 1) >> 1;
+			green[g] = s[g];
+			other[g] = (u[g] + d[g] + 1) >> 1;
+		}
+		for (int i = 0; i < n; i++)
+		{
+			o[3 * i] = r[i];
+			o[3 * i + 1] = green[i];
+			o[3 * i + 2] = b[i];
+		}
+	}
+}
+
+// one pixel per 2x2 block, REDX is the column of the red sample in a block
+template <int PX, int REDX>
+void ofxV4L2DemosaicHalf(unsigned char * __restrict dst, const unsigned char * __restrict red, const unsigned char * __restrict blue,
+	const unsigned char *, int width)
+{
+	for (int i = 0; i < width; i++)
+		ofxV4L2StoreBayer<PX, 1>(dst + i * PX, red[2 * i + REDX], (red[2 * i + 1 - REDX] + blue[2 * i + REDX] + 1) >> 1,
+			blue[2 * i + 1 - REDX]);
+}
+
+// a remap kernel writes n output pixels, interpolating bilinearly between the four captured
+// samples at offset[i] (byte offset of the top left luma sample in the buffer) and to the right
+// and below it; frac[i] holds the weights of the right (low 16 bits) and lower (high 16 bits)
+// samples in 1/256, 0 to 256 (256 only on the last column and line), stride is the distance
+// between captured lines
+typedef void (* ofxV4L2RemapKernel)(unsigned char * dst, const unsigned char * src, const unsigned int * offset,
+	const unsigned int * frac, int n, int stride);
+
+// capture formats that can be remapped: luma of pixel x is at STEP * x + Y in a line
+struct ofxV4L2RemapFormat
+{
+	unsigned int pixelformat;
+	int step, y;
+	int u, v;					// chroma of a pixel is in the 4 byte macropixel it belongs to, -1 for GREY
+	ofxV4L2RemapKernel gray, rgb;
+};
+
+// returns NULL if the format cannot be remapped
+const ofxV4L2RemapFormat * ofxV4L2FindRemap(unsigned int pixelformat);
+
+static inline int ofxV4L2Bilinear(const unsigned char * p, int step, int stride, int fx, int fy)
+{
+	int top = p[0] * (256 - fx) + p[step] * fx;
+	int bottom = p[stride] * (256 - fx) + p[stride + step] * fx;
+	return (top * (256 - fy) + bottom * fy + 32768) >> 16;
+}
+
+// STEP, Y: see ofxV4L2RemapFormat; U, V < 0: the source has no chroma
+template <int PX, int STEP, int U, int V>
+void ofxV4L2Remap(unsigned char * __restrict dst, const unsigned char * __restrict src, const unsigned int * __restrict offset,
+	const unsigned int * __restrict frac, int n, int stride)
+{
+	for (int i = 0; i < n; i++)
+	{
+		const unsigned char * p = src + offset[i];
+		int fx = frac[i] & 0xffff, fy = frac[i] >> 16;
+		int y = ofxV4L2Bilinear(p, STEP, stride, fx, fy);
+
+		if (1 == PX)
+			dst[i] = y;
+		else if (U < 0)
+			dst[3 * i] = dst[3 * i + 1] = dst[3 * i + 2] = y;
+		else
+		{
+			// chroma is half resolution already: take it from the macropixel of the nearest of the
+			// four samples (lines are a multiple of 4 bytes)
+			const unsigned char * m = src + ((offset[i] + (fx >= 128 ? STEP : 0) + (fy >= 128 ? stride : 0)) & ~3u);
+			ofxV4L2YuvToRgb (dst + 3 * i, y, m[U], m[V]);
+		}
+	}
+}
+
+#endif // OFXV4L2_KERNELS_H
@@ -0,0 +1,696 @@
+/**
+ *
+ * ofxV4L2Recorder - lossless compressed recording of captured frames
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **/
+
+#include "ofxV4L2Recorder.h"
+
+#ifdef OFXV4L2_LZ4
+#include <lz4.h>
+#endif
+#ifdef OFXV4L2_ZSTD
+#include <zstd.h>
+#endif
+
+#define RECORD_MAGIC 		"OV4LREC1"
+#define RECORD_FOOTER 		"OV4LIDX1"
+#define CHUNK_KEY 			1			// frame stored without delta
+#define CHUNK_STORED 		0x80000000u	// frame stored uncompressed because the codec failed
+
+// slot states
+#define SLOT_FREE 			0
+#define SLOT_FILLING 		1
+#define SLOT_QUEUED 		2
+#define SLOT_COMPRESSING 	3
+#define SLOT_DONE 			4
+
+struct ofxV4L2RecordHeader
+{
+	char magic[8];
+	unsigned int width, height;
+	unsigned int pixelformat;
+	unsigned int length;			// bytes of an uncompressed frame
+	unsigned int codec;
+	unsigned int delta;
+	unsigned int keyinterval;
+	unsigned int reserved[7];
+};
+
+struct ofxV4L2RecordChunk
+{
+	unsigned int size;				// bytes of data following the chunk header
+	unsigned int flags;
+	unsigned int sequence;
+	unsigned int reserved;
+	long long tv_sec, tv_usec;
+};
+
+// same layout as ofxV4L2Recorder::indexentry, which is what the recorder writes
+struct ofxV4L2RecordIndex
+{
+	unsigned long long offset;		// file offset of the chunk header
+	unsigned int size;
+	unsigned int flags;
+};
+
+struct ofxV4L2RecordFooter
+{
+	unsigned long long index;		// file offset of the index
+	unsigned int frames;
+	unsigned int reserved;
+	char magic[8];
+};
+
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// difference with the previous frame (wrapping), and update of the previous frame, in one pass
+static void delta_copy(unsigned char * __restrict dst, unsigned char * __restrict prev, const unsigned char * __restrict src, unsigned int length)
+{
+	for (unsigned int i = 0; i < length; i++)
+	{
+		dst[i] = src[i] - prev[i];
+		prev[i] = src[i];
+	}
+}
+
+static void delta_add(unsigned char * __restrict dst, const unsigned char * __restrict diff, unsigned int length)
+{
+	for (unsigned int i = 0; i < length; i++)
+		dst[i] += diff[i];
+}
+
+ofxV4L2Recorder::ofxV4L2Recorder()
+{
+	file = NULL;
+	previous = NULL;
+	recording = false;
+	stopping = false;
+	// addFrame() runs on the real-time capture thread and shares the lock with the (SCHED_OTHER)
+	// workers: priority inheritance keeps a preempted worker from blocking it
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init (&attr);
+	if (0 != pthread_mutexattr_setprotocol (&attr, PTHREAD_PRIO_INHERIT))
+		fprintf (stderr, "Recorder lock without priority inheritance\n");
+	pthread_mutex_init (&lock, &attr);
+	pthread_mutexattr_destroy (&attr);
+	pthread_cond_init (&queued, NULL);
+	pthread_cond_init (&compressed, NULL);
+	CLEAR (recstats);
+}
+
+bool ofxV4L2Recorder::open(const char * filename, unsigned int width, unsigned int height, unsigned int framelength,
+	unsigned int pixelformat, int framecodec, bool deltacoding, int threads, int queue, int interval)
+{
+	struct ofxV4L2RecordHeader h;
+	int i;
+
+	if (recording)
+		close();
+
+	if (RECORD_DEFAULT == framecodec)
+	{
+#if defined(OFXV4L2_LZ4)
+		framecodec = RECORD_LZ4;
+#elif defined(OFXV4L2_ZSTD)
+		framecodec = RECORD_ZSTD;
+#else
+		framecodec = RECORD_NONE;
+#endif
+	}
+
+	switch (framecodec)
+	{
+		case RECORD_NONE:
+			bound = framelength;
+			break;
+#ifdef OFXV4L2_LZ4
+		case RECORD_LZ4:
+			bound = LZ4_compressBound (framelength);
+			break;
+#endif
+#ifdef OFXV4L2_ZSTD
+		case RECORD_ZSTD:
+			bound = ZSTD_compressBound (framelength);
+			break;
+#endif
+		default:
+			fprintf (stderr, "Recording codec %d is not available (compile with OFXV4L2_LZ4 or OFXV4L2_ZSTD)\n", framecodec);
+			return false;
+	}
+
+	file = fopen (filename, "wb");
+	if (!file)
+	{
+		fprintf (stderr, "Cannot create '%s': %d, %s\n", filename, errno, strerror (errno));
+		return false;
+	}
+
+	length = framelength;
+	codec = framecodec;
+	delta = deltacoding;
+	keyinterval = interval > 0 ? interval : 1;
+
+	CLEAR (h);
+	memcpy (h.magic, RECORD_MAGIC, sizeof (h.magic));
+	h.width = width;
+	h.height = height;
+	h.pixelformat = pixelformat;
+	h.length = length;
+	h.codec = codec;
+	h.delta = delta;
+	h.keyinterval = keyinterval;
+	if (1 != fwrite (&h, sizeof (h), 1, file))
+	{
+		fprintf (stderr, "Cannot write '%s': %d, %s\n", filename, errno, strerror (errno));
+		fclose (file);
+		file = NULL;
+		return false;
+	}
+	offset = sizeof (h);
+
+	// all memory is allocated here, so addFrame() does not allocate
+	previous = new unsigned char[length];
+	slots.resize(queue > 1 ? queue : 2);
+	for (i = 0; i < (int) slots.size(); i++)
+	{
+		slots[i].state = SLOT_FREE;
+		slots[i].raw = new unsigned char[length];
+		slots[i].packed = new unsigned char[bound];
+	}
+	index.clear();
+	index.reserve(1024);
+	next = next_write = 0;
+	CLEAR (recstats);
+	started = now_ms();
+	stopping = false;
+	recording = true;
+
+	workers.resize(threads > 0 ? threads : 1);
+	for (i = 0; i < (int) workers.size(); i++)
+		pthread_create (&workers[i], NULL, worker_thread, this);
+	pthread_create (&writer_id, NULL, writer_thread, this);
+
+	fprintf (stdout, "Recording to %s (codec %d, %s, %d threads)\n", filename, codec, delta ? "delta" : "intra", (int) workers.size());
+	return true;
+}
+
+bool ofxV4L2Recorder::addFrame(const void * data, const ofxV4L2::frameinfo & info)
+{
+	slot * s;
+	bool key;
+
+	pthread_mutex_lock (&lock);
+	if (!recording || stopping)
+	{
+		pthread_mutex_unlock (&lock);
+		return false;
+	}
+	s = &slots[next % slots.size()];
+	if (SLOT_FREE != s->state)
+	{
+		recstats.dropped++;
+		pthread_mutex_unlock (&lock);
+		return false;
+	}
+	s->state = SLOT_FILLING;
+	s->number = next++;
+	pthread_mutex_unlock (&lock);
+
+	// the copy is done outside the lock; only this thread touches a filling slot
+	key = !delta || 0 == s->number % keyinterval;
+	if (key)
+	{
+		memcpy (s->raw, data, length);
+		if (delta)
+			memcpy (previous, data, length);
+	}
+	else
+	{
+		delta_copy (s->raw, previous, (const unsigned char *) data, length);
+	}
+	s->key = key;
+	s->sequence = info.sequence;
+	s->timestamp = info.timestamp;
+
+	pthread_mutex_lock (&lock);
+	s->state = SLOT_QUEUED;
+	// once close() has set stopping, all workers may be waiting for this slot: wake all of them,
+	// the ones that find nothing left to do then end
+	if (stopping)
+		pthread_cond_broadcast (&queued);
+	else
+		pthread_cond_signal (&queued);
+	pthread_mutex_unlock (&lock);
+	return true;
+}
+
+unsigned int ofxV4L2Recorder::compress(const unsigned char * src, unsigned char * dst, unsigned int capacity)
+{
+	switch (codec)
+	{
+#ifdef OFXV4L2_LZ4
+		case RECORD_LZ4:
+			return LZ4_compress_default ((const char *) src, (char *) dst, length, capacity);
+#endif
+#ifdef OFXV4L2_ZSTD
+		case RECORD_ZSTD:
+		{
+			size_t r = ZSTD_compress (dst, capacity, src, length, 1);
+			return ZSTD_isError (r) ? 0 : r;
+		}
+#endif
+		default:
+			(void) capacity;
+			memcpy (dst, src, length);
+			return length;
+	}
+}
+
+void * ofxV4L2Recorder::worker_thread(void * arg)
+{
+	((ofxV4L2Recorder *) arg)->worker();
+	return NULL;
+}
+
+void * ofxV4L2Recorder::writer_thread(void * arg)
+{
+	((ofxV4L2Recorder *) arg)->writer();
+	return NULL;
+}
+
+// compresses queued slots, oldest first
+void ofxV4L2Recorder::worker(void)
+{
+	unsigned int i;
+	slot * s;
+	bool filling;
+	double start;
+
+	pthread_mutex_lock (&lock);
+	for (;;)
+	{
+		s = NULL;
+		filling = false;
+		for (i = 0; i < slots.size(); i++)
+		{
+			if (SLOT_QUEUED == slots[i].state && (!s || slots[i].number < s->number))
+				s = &slots[i];
+			filling = filling || SLOT_FILLING == slots[i].state;
+		}
+
+		if (!s)
+		{
+			// a slot being filled by addFrame() is queued shortly, wait for it when stopping
+			if (stopping && !filling)
+				break;
+			pthread_cond_wait (&queued, &lock);
+			continue;
+		}
+
+		s->state = SLOT_COMPRESSING;
+		pthread_mutex_unlock (&lock);
+
+		start = now_ms();
+		s->packed_length = compress(s->raw, s->packed, bound);
+
+		pthread_mutex_lock (&lock);
+		recstats.compress_ms += now_ms() - start;
+		s->state = SLOT_DONE;
+		pthread_cond_broadcast (&compressed);
+	}
+	pthread_mutex_unlock (&lock);
+}
+
+// appends compressed slots to the file in frame order
+void ofxV4L2Recorder::writer(void)
+{
+	struct ofxV4L2RecordChunk chunk;
+	indexentry entry;
+	slot * s;
+	bool written;
+
+	pthread_mutex_lock (&lock);
+	for (;;)
+	{
+		s = &slots[next_write % slots.size()];
+		if (SLOT_DONE != s->state || s->number != next_write)
+		{
+			// stop once everything that was added has been written
+			if (stopping && next_write == next)
+				break;
+			pthread_cond_wait (&compressed, &lock);
+			continue;
+		}
+		pthread_mutex_unlock (&lock);
+
+		CLEAR (chunk);
+		chunk.size = s->packed_length;
+		chunk.flags = s->key ? CHUNK_KEY : 0;
+		chunk.sequence = s->sequence;
+		chunk.tv_sec = s->timestamp.tv_sec;
+		chunk.tv_usec = s->timestamp.tv_usec;
+		if (0 == s->packed_length)
+		{
+			// the codec failed: store the frame as it is
+			chunk.size = length;
+			chunk.flags |= CHUNK_STORED;
+			memcpy (s->packed, s->raw, length);
+		}
+		// after a failed write the file ends at the last complete chunk, later frames are dropped
+		written = false;
+		if (!recstats.failed)
+		{
+			written = 1 == fwrite (&chunk, sizeof (chunk), 1, file) && 1 == fwrite (s->packed, chunk.size, 1, file);
+			if (written)
+			{
+				entry.offset = offset;
+				entry.size = chunk.size;
+				entry.flags = chunk.flags;
+				index.push_back(entry);
+				offset += sizeof (chunk) + chunk.size;
+			}
+			else
+				fprintf (stderr, "Recording write failed: %d, %s\n", errno, strerror (errno));
+		}
+
+		pthread_mutex_lock (&lock);
+		if (written)
+		{
+			recstats.frames++;
+			recstats.raw_bytes += length;
+			recstats.packed_bytes += chunk.size;
+		}
+		else
+		{
+			recstats.failed = true;
+			recstats.dropped++;
+		}
+		s->state = SLOT_FREE;
+		next_write++;
+	}
+	pthread_mutex_unlock (&lock);
+}
+
+bool ofxV4L2Recorder::close(void)
+{
+	struct ofxV4L2RecordFooter footer;
+	unsigned int i;
+	bool ok;
+
+	if (!recording)
+		return true;
+
+	pthread_mutex_lock (&lock);
+	stopping = true;
+	pthread_cond_broadcast (&queued);
+	pthread_cond_broadcast (&compressed);
+	pthread_mutex_unlock (&lock);
+
+	// frames that are being filled are still queued and written before the threads end
+	for (i = 0; i < workers.size(); i++)
+		pthread_join (workers[i], NULL);
+	pthread_mutex_lock (&lock);
+	pthread_cond_broadcast (&compressed);
+	pthread_mutex_unlock (&lock);
+	pthread_join (writer_id, NULL);
+
+	CLEAR (footer);
+	footer.index = offset;
+	footer.frames = index.size();
+	memcpy (footer.magic, RECORD_FOOTER, sizeof (footer.magic));
+	// the index of the frames written so far, also after a failed write (the player needs the footer)
+	ok = !recstats.failed;
+	if (!ok)
+		fseeko (file, offset, SEEK_SET);
+	if (!index.empty() && index.size() != fwrite (&index[0], sizeof (indexentry), index.size(), file))
+		ok = false;
+	if (1 != fwrite (&footer, sizeof (footer), 1, file))
+		ok = false;
+	if (0 != fclose (file))
+		ok = false;
+	file = NULL;
+	if (!ok)
+		fprintf (stderr, "Recording is incomplete: %d, %s\n", errno, strerror (errno));
+
+	recstats.elapsed_ms = now_ms() - started;
+	fprintf (stdout, "Recorded %lu frames (%lu dropped), compression ratio %.2f\n", recstats.frames, recstats.dropped, getCompressionRatio());
+
+	for (i = 0; i < slots.size(); i++)
+	{
+		delete [] slots[i].raw;
+		delete [] slots[i].packed;
+	}
+	slots.clear();
+	delete [] previous;
+	previous = NULL;
+	recording = false;
+	return ok;
+}
+
+bool ofxV4L2Recorder::isRecording(void)
+{
+	return recording;
+}
+
+const ofxV4L2Recorder::stats & ofxV4L2Recorder::getStats(void)
+{
+	if (recording)
+		recstats.elapsed_ms = now_ms() - started;
+	return recstats;
+}
+
+double ofxV4L2Recorder::getCompressionRatio(void)
+{
+	return recstats.packed_bytes ? (double) recstats.raw_bytes / recstats.packed_bytes : 0;
+}
+
+double ofxV4L2Recorder::getThroughput(void)
+{
+	getStats();
+	return recstats.elapsed_ms > 0 ? recstats.raw_bytes / 1000.0 / recstats.elapsed_ms : 0;
+}
+
+ofxV4L2Recorder::~ofxV4L2Recorder()
+{
+	close();
+	pthread_mutex_destroy (&lock);
+	pthread_cond_destroy (&queued);
+	pthread_cond_destroy (&compressed);
+}
+
+ofxV4L2Player::ofxV4L2Player()
+{
+	data = NULL;
+	size = 0;
+	frames = 0;
+	frame = NULL;
+	diff = NULL;
+	decoded = -1;
+}
+
+bool ofxV4L2Player::open(const char * filename)
+{
+	const struct ofxV4L2RecordFooter * footer;
+	struct stat st;
+	int fd;
+
+	close();
+
+	fd = ::open (filename, O_RDONLY);
+	if (-1 == fd)
+	{
+		fprintf (stderr, "Cannot open '%s': %d, %s\n", filename, errno, strerror (errno));
+		return false;
+	}
+	if (-1 == fstat (fd, &st) || st.st_size < (off_t) (sizeof (ofxV4L2RecordHeader) + sizeof (ofxV4L2RecordFooter)))
+	{
+		fprintf (stderr, "'%s' is no recording\n", filename);
+		::close (fd);
+		return false;
+	}
+
+	size = st.st_size;
+	data = (const unsigned char *) mmap (NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	::close (fd);
+	if (MAP_FAILED == data)
+	{
+		data = NULL;
+		fprintf (stderr, "Cannot map '%s': %d, %s\n", filename, errno, strerror (errno));
+		return false;
+	}
+
+	header = (const ofxV4L2RecordHeader *) data;
+	footer = (const ofxV4L2RecordFooter *) (data + size - sizeof (*footer));
+	if (memcmp (header->magic, RECORD_MAGIC, sizeof (header->magic))
+		|| memcmp (footer->magic, RECORD_FOOTER, sizeof (footer->magic))
+		|| footer->index + (unsigned long long) footer->frames * sizeof (ofxV4L2RecordIndex) > size)
+	{
+		fprintf (stderr, "'%s' is no complete recording\n", filename);
+		close();
+		return false;
+	}
+
+	index = (const ofxV4L2RecordIndex *) (data + footer->index);
+	frames = footer->frames;
+	frame = new unsigned char[header->length];
+	diff = new unsigned char[header->length];
+	decoded = -1;
+
+	// playback reads the file front to back
+	madvise ((void *) data, size, MADV_SEQUENTIAL);
+	return true;
+}
+
+unsigned int ofxV4L2Player::getNumFrames(void)
+{
+	return frames;
+}
+
+unsigned int ofxV4L2Player::getWidth(void)
+{
+	return data ? header->width : 0;
+}
+
+unsigned int ofxV4L2Player::getHeight(void)
+{
+	return data ? header->height : 0;
+}
+
+unsigned int ofxV4L2Player::getPixelFormat(void)
+{
+	return data ? header->pixelformat : 0;
+}
+
+unsigned int ofxV4L2Player::getFrameLength(void)
+{
+	return data ? header->length : 0;
+}
+
+// decompresses the data of chunk n into dst
+bool ofxV4L2Player::decode(unsigned int n, unsigned char * dst)
+{
+	const unsigned char * src = data + index[n].offset + sizeof (ofxV4L2RecordChunk);
+	unsigned int codec = header->codec;
+
+	if (index[n].offset + sizeof (ofxV4L2RecordChunk) + index[n].size > size)
+		return false;
+
+	// frames the codec could not compress are stored as they are
+	if (index[n].flags & CHUNK_STORED)
+		codec = RECORD_NONE;
+
+	switch (codec)
+	{
+		case RECORD_NONE:
+			if (index[n].size != header->length)
+				return false;
+			memcpy (dst, src, header->length);
+			return true;
+#ifdef OFXV4L2_LZ4
+		case RECORD_LZ4:
+			return LZ4_decompress_safe ((const char *) src, (char *) dst, index[n].size, header->length) == (int) header->length;
+#endif
+#ifdef OFXV4L2_ZSTD
+		case RECORD_ZSTD:
+			return ZSTD_decompress (dst, header->length, src, index[n].size) == header->length;
+#endif
+		default:
+			return false;
+	}
+}
+
+const unsigned char * ofxV4L2Player::getFrame(unsigned int n, unsigned int * sequence, struct timeval * timestamp)
+{
+	const struct ofxV4L2RecordChunk * chunk;
+	long k;
+
+	if (!data || n >= frames)
+		return NULL;
+
+	if ((long) n != decoded)
+	{
+		// continue from the last decoded frame if possible, otherwise from the nearest keyframe
+		if (index[n].flags & CHUNK_KEY || (long) n < decoded || decoded < 0)
+		{
+			for (k = n; k > 0 && !(index[k].flags & CHUNK_KEY); k--)
+				;
+			if (!decode(k, frame))
+			{
+				decoded = -1;
+				return NULL;
+			}
+		}
+		else
+		{
+			k = decoded;
+		}
+
+		for (k++; k <= (long) n; k++)
+		{
+			if (index[k].flags & CHUNK_KEY)
+			{
+				if (!decode(k, frame))
+				{
+					decoded = -1;
+					return NULL;
+				}
+				continue;
+			}
+			if (!decode(k, diff))
+			{
+				decoded = -1;
+				return NULL;
+			}
+			delta_add (frame, diff, header->length);
+		}
+		decoded = n;
+	}
+
+	chunk = (const ofxV4L2RecordChunk *) (data + index[n].offset);
+	if (sequence)
+		*sequence = chunk->sequence;
+	if (timestamp)
+	{
+		timestamp->tv_sec = chunk->tv_sec;
+		timestamp->tv_usec = chunk->tv_usec;
+	}
+	return frame;
+}
+
+void ofxV4L2Player::close(void)
+{
+	if (!data)
+		return;
+
+	munmap ((void *) data, size);
+	data = NULL;
+	delete [] frame;
+	delete [] diff;
+	frame = diff = NULL;
+	frames = 0;
+	decoded = -1;
+}
+
+ofxV4L2Player::~ofxV4L2Player()
+{
+	close();
+}
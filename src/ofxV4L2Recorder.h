@@ -0,0 +1,170 @@
+/**
+ *
+ * ofxV4L2Recorder - lossless compressed recording of captured frames
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESCRIPTION
+ *
+ * addFrame() copies a frame into one of a fixed number of slots (optionally as the
+ * difference with the previous frame) and returns; a pool of worker threads compresses
+ * the slots in parallel and a writer thread appends them to the file in order. When all
+ * slots are in use the frame is dropped instead of blocking the capture path.
+ *
+ * Compression uses LZ4 and/or zstd, enabled by compiling with OFXV4L2_LZ4 and/or
+ * OFXV4L2_ZSTD defined (and linking -llz4 / -lzstd). Without them frames are stored
+ * uncompressed (but still delta coded, if asked for).
+ *
+ * File layout: a header, one chunk per frame (chunk header + data) and an index with
+ * the file offset of every chunk, followed by a footer pointing at the index. Every
+ * keyinterval-th frame is stored without delta, so ofxV4L2Player can seek to any frame
+ * by decoding from the nearest keyframe.
+ *
+ **/
+
+#ifndef OFXV4L2_RECORDER_H
+#define OFXV4L2_RECORDER_H
+
+#include "ofxV4L2.h"
+
+#include <vector>
+
+class ofxV4L2Recorder
+{
+	public:
+
+		ofxV4L2Recorder();
+
+		// starts a recording of frames of 'length' bytes, codec is one of the RECORD_ defines in ofxV4L2.h
+		// (RECORD_DEFAULT picks the best one compiled in)
+		// delta: store the difference with the previous frame, which compresses much better for static scenes
+		// threads: number of compression workers; queue: number of frames that can be waiting or in progress
+		// returns false if the file cannot be created or the codec was not compiled in
+		bool open(const char * filename, unsigned int width, unsigned int height, unsigned int length,
+			unsigned int pixelformat, int codec = RECORD_DEFAULT, bool delta = true, int threads = 2,
+			int queue = 8, int keyinterval = 30);
+
+		// queues a frame for compression, never blocks (call from a single thread, e.g. the capture thread)
+		// returns false if the frame was dropped because all slots are busy (or nothing is being recorded)
+		bool addFrame(const void * data, const ofxV4L2::frameinfo & info);
+
+		// writes the remaining frames and the index, and closes the file
+		// returns false if a write failed (e.g. the disk is full): the recording is incomplete
+		bool close(void);
+
+		bool isRecording(void);
+
+		struct stats
+		{
+			unsigned long frames;			// frames written
+			unsigned long dropped;			// frames dropped by addFrame() or after a write error
+			bool failed;					// a write failed, frames are no longer written
+			unsigned long long raw_bytes;	// bytes of the written frames before compression
+			unsigned long long packed_bytes;	// bytes of the written frames after compression
+			double compress_ms;				// total time spent compressing, summed over the workers
+			double elapsed_ms;				// time since open()
+		};
+		const stats & getStats(void);
+		double getCompressionRatio(void);	// raw_bytes / packed_bytes
+		double getThroughput(void);			// MB of raw frames written per second of recording
+
+		~ofxV4L2Recorder();
+
+	private:
+
+		struct slot
+		{
+			int state;
+			unsigned char * raw;
+			unsigned char * packed;
+			unsigned int packed_length;
+			unsigned long number;			// frame number in the recording
+			bool key;
+			unsigned int sequence;
+			struct timeval timestamp;
+		};
+
+		struct indexentry
+		{
+			unsigned long long offset;
+			unsigned int size;
+			unsigned int flags;
+		};
+
+		static void * worker_thread(void * arg);
+		static void * writer_thread(void * arg);
+		void worker(void);
+		void writer(void);
+		unsigned int compress(const unsigned char * src, unsigned char * dst, unsigned int capacity);
+
+		FILE * file;
+		unsigned int length, bound;
+		int codec;
+		bool delta;
+		int keyinterval;
+		unsigned char * previous;		// previous frame, for delta coding
+
+		std::vector<slot> slots;
+		std::vector<pthread_t> workers;
+		pthread_t writer_id;
+		pthread_mutex_t lock;
+		pthread_cond_t queued, compressed;
+		std::atomic<bool> recording;	// read by the capture thread without the lock
+		bool stopping;
+		unsigned long next;				// number of the next frame added
+		unsigned long next_write;		// number of the next frame to write
+
+		std::vector<indexentry> index;
+		unsigned long long offset;
+		stats recstats;
+		double started;
+};
+
+class ofxV4L2Player
+{
+	public:
+
+		ofxV4L2Player();
+
+		// maps a recording, returns false if it is no (complete) recording
+		bool open(const char * filename);
+
+		unsigned int getNumFrames(void);
+		unsigned int getWidth(void);
+		unsigned int getHeight(void);
+		unsigned int getPixelFormat(void);
+		unsigned int getFrameLength(void);
+
+		// decodes frame n; sequential playback only decodes one frame per call
+		// returns NULL if n is out of range or the data cannot be decoded
+		const unsigned char * getFrame(unsigned int n, unsigned int * sequence = NULL, struct timeval * timestamp = NULL);
+
+		void close(void);
+		~ofxV4L2Player();
+
+	private:
+
+		bool decode(unsigned int n, unsigned char * dst);
+
+		const unsigned char * data;
+		size_t size;
+		const struct ofxV4L2RecordHeader * header;
+		const struct ofxV4L2RecordIndex * index;
+		unsigned int frames;
+		unsigned char * frame;			// last decoded frame
+		unsigned char * diff;			// decoded delta
+		long decoded;					// number of the frame in 'frame', -1 if none
+};
+
+#endif // OFXV4L2_RECORDER_H
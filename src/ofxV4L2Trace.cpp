@@ -0,0 +1,197 @@
+/**
+ *
+ * ofxV4L2Trace - per-stage trace points of the capture pipeline
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **/
+
+#include "ofxV4L2Trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+struct ofxV4L2TraceEvent
+{
+	const char * name;
+	unsigned long long start;		// ns, CLOCK_MONOTONIC
+	unsigned int duration;			// ns
+	unsigned int frame;				// sequence number or TRACE_NO_FRAME
+};
+
+// one per thread, written by that thread only; rings live until the process exits
+struct ofxV4L2TraceRing
+{
+	ofxV4L2TraceRing * next;
+	pid_t tid;
+	char name[16];
+	std::atomic<unsigned long long> head;		// number of events written
+	std::atomic<unsigned long long> from;		// events before this one were cleared
+	ofxV4L2TraceEvent events[TRACE_EVENTS];
+};
+
+std::atomic<bool> ofxV4L2Trace::enabled(false);
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static ofxV4L2TraceRing * rings = NULL;
+static __thread ofxV4L2TraceRing * thread_ring = NULL;
+static const char * exit_file = NULL;
+
+// allocates the ring of the calling thread on its first event
+static ofxV4L2TraceRing * new_ring(void)
+{
+	ofxV4L2TraceRing * r = (ofxV4L2TraceRing *) calloc (1, sizeof (ofxV4L2TraceRing));
+
+	if (!r)
+		return NULL;
+
+	r->tid = syscall (SYS_gettid);
+	if (0 != pthread_getname_np (pthread_self (), r->name, sizeof (r->name)))
+		r->name[0] = 0;
+
+	pthread_mutex_lock (&rings_lock);
+	r->next = rings;
+	rings = r;
+	pthread_mutex_unlock (&rings_lock);
+	return r;
+}
+
+static void save_at_exit(void)
+{
+	ofxV4L2Trace::save(exit_file);
+}
+
+// OFXV4L2_TRACE=<file> starts tracing before main() and saves the trace at exit
+static struct trace_from_environment
+{
+	trace_from_environment()
+	{
+		exit_file = getenv ("OFXV4L2_TRACE");
+		if (!exit_file || !*exit_file)
+			return;
+		ofxV4L2Trace::enable(true);
+		atexit (save_at_exit);
+	}
+} from_environment;
+
+void ofxV4L2Trace::enable(bool on)
+{
+	enabled.store(on, std::memory_order_relaxed);
+}
+
+bool ofxV4L2Trace::isEnabled(void)
+{
+	return enabled.load(std::memory_order_relaxed);
+}
+
+void ofxV4L2Trace::end(unsigned long long start, const char * name, unsigned int frame)
+{
+	ofxV4L2TraceRing * r = thread_ring;
+	ofxV4L2TraceEvent * e;
+	unsigned long long n, duration = now() - start;
+
+	if (!r && !(r = thread_ring = new_ring ()))
+		return;
+
+	n = r->head.load(std::memory_order_relaxed);
+	e = &r->events[n % TRACE_EVENTS];
+	e->name = name;
+	e->start = start;
+	e->duration = duration > 0xffffffffULL ? 0xffffffffU : duration;
+	e->frame = frame;
+	r->head.store(n + 1, std::memory_order_release);
+}
+
+void ofxV4L2Trace::clear(void)
+{
+	ofxV4L2TraceRing * r;
+
+	pthread_mutex_lock (&rings_lock);
+	for (r = rings; r; r = r->next)
+		r->from.store(r->head.load(std::memory_order_acquire), std::memory_order_relaxed);
+	pthread_mutex_unlock (&rings_lock);
+}
+
+bool ofxV4L2Trace::save(const char * filename)
+{
+	ofxV4L2TraceEvent * copy;
+	ofxV4L2TraceRing * r;
+	unsigned long long n, first, last, oldest;
+	const char * sep = "";
+	char name[16];
+	pid_t pid = getpid ();
+	unsigned int i;
+	FILE * f;
+
+	copy = (ofxV4L2TraceEvent *) malloc (TRACE_EVENTS * sizeof (ofxV4L2TraceEvent));
+	f = fopen (filename, "w");
+	if (!copy || !f)
+	{
+		fprintf (stderr, "Cannot write trace to %s\n", filename);
+		free (copy);
+		if (f)
+			fclose (f);
+		return false;
+	}
+
+	fprintf (f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	pthread_mutex_lock (&rings_lock);
+	for (r = rings; r; r = r->next)
+	{
+		// copy the ring, then drop what the thread may have overwritten during the copy
+		last = r->head.load(std::memory_order_acquire);
+		first = r->from.load(std::memory_order_relaxed);
+		if (last > TRACE_EVENTS && first < last - TRACE_EVENTS)
+			first = last - TRACE_EVENTS;
+		for (n = first; n < last; n++)
+			copy[n % TRACE_EVENTS] = r->events[n % TRACE_EVENTS];
+		std::atomic_thread_fence (std::memory_order_acquire);
+		oldest = r->head.load(std::memory_order_relaxed) + 1;
+		if (oldest > TRACE_EVENTS && first < oldest - TRACE_EVENTS)
+			first = oldest - TRACE_EVENTS;
+
+		// thread names end up in the JSON as they are, so keep them plain
+		for (i = 0; i < sizeof (name) - 1 && r->name[i]; i++)
+			name[i] = '"' == r->name[i] || '\\' == r->name[i] || r->name[i] < ' ' ? '_' : r->name[i];
+		name[i] = 0;
+		fprintf (f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			sep, pid, r->tid, name);
+		sep = ",";
+
+		for (n = first; n < last; n++)
+		{
+			const ofxV4L2TraceEvent & e = copy[n % TRACE_EVENTS];
+			fprintf (f, ",\n{\"name\":\"%s\",\"cat\":\"ofxV4L2\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%llu.%03llu,\"dur\":%u.%03u",
+				e.name, pid, r->tid, e.start / 1000, e.start % 1000, e.duration / 1000, e.duration % 1000);
+			if (TRACE_NO_FRAME != e.frame)
+				fprintf (f, ",\"args\":{\"frame\":%u}", e.frame);
+			fprintf (f, "}");
+		}
+	}
+	pthread_mutex_unlock (&rings_lock);
+	fprintf (f, "\n]}\n");
+
+	free (copy);
+	if (0 != fclose (f))
+	{
+		fprintf (stderr, "Cannot write trace to %s\n", filename);
+		return false;
+	}
+	fprintf (stdout, "Trace written to %s\n", filename);
+	return true;
+}
@@ -0,0 +1,88 @@
+/**
+ *
+ * ofxV4L2Trace - per-stage trace points of the capture pipeline
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESCRIPTION
+ *
+ * The stages of the capture path (select, VIDIOC_DQBUF, process_image, VIDIOC_QBUF, the
+ * application between two grabFrame() calls, ...) are marked with TRACE_BEGIN / TRACE_END.
+ * While tracing is off a trace point costs one relaxed atomic load. While it is on, every
+ * thread writes its events into a ring of its own (no locks, the oldest events are
+ * overwritten), and save() writes them in the Chrome trace format, which can be opened in
+ * chrome://tracing or https://ui.perfetto.dev.
+ *
+ * Tracing is started with ofxV4L2Trace::enable(), or without changing the application by
+ * setting OFXV4L2_TRACE=<file> in the environment: the trace is then written to <file>
+ * when the process exits. Compiling with OFXV4L2_NO_TRACE defined removes the trace points.
+ *
+ **/
+
+#ifndef OFXV4L2_TRACE_H
+#define OFXV4L2_TRACE_H
+
+#include <time.h>
+#include <atomic>
+
+#define TRACE_EVENTS 	16384		// events kept per thread
+#define TRACE_NO_FRAME 	(~0u)		// for events that belong to no frame
+
+class ofxV4L2Trace
+{
+	public:
+
+		static void enable(bool on);
+		static bool isEnabled(void);
+
+		// writes the events of all threads as Chrome trace JSON, returns false if the file cannot be written
+		// can be called while tracing continues
+		static bool save(const char * filename);
+
+		// forgets the events recorded so far
+		static void clear(void);
+
+		// used by the trace macros: begin() returns 0 while tracing is off
+		static inline unsigned long long begin(void)
+		{
+			return enabled.load(std::memory_order_relaxed) ? now() : 0;
+		}
+		static void end(unsigned long long start, const char * name, unsigned int frame);
+
+		static inline unsigned long long now(void)
+		{
+			struct timespec ts;
+			clock_gettime (CLOCK_MONOTONIC, &ts);
+			return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		}
+
+	private:
+
+		static std::atomic<bool> enabled;
+};
+
+// name must be a string literal, the ring only stores the pointer
+#ifndef OFXV4L2_NO_TRACE
+#define TRACE_BEGIN(t) 					unsigned long long t = ofxV4L2Trace::begin()
+#define TRACE_RESTART(t) 				t = ofxV4L2Trace::begin()
+#define TRACE_END(t, name) 				do { if (t) ofxV4L2Trace::end(t, name, TRACE_NO_FRAME); } while (0)
+#define TRACE_FRAME(t, name, sequence) 	do { if (t) ofxV4L2Trace::end(t, name, sequence); } while (0)
+#else
+#define TRACE_BEGIN(t)
+#define TRACE_RESTART(t)
+#define TRACE_END(t, name)
+#define TRACE_FRAME(t, name, sequence)
+#endif
+
+#endif // OFXV4L2_TRACE_H